@@ -0,0 +1,178 @@
+// Times the conversion kernels on synthetic 1280x720 frames, linking nothing but the kernel
+// library. Built with `scons frame_kernels_bench`, add `sanitize=yes` to check the kernels with
+// AddressSanitizer and UndefinedBehaviorSanitizer. Exits with 1 if a kernel rejects its input or
+// gets one of the known values below wrong.
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include "core/frame_kernels.h"
+
+using namespace frame_kernels;
+
+static const int WIDTH = 1280;
+static const int HEIGHT = 720;
+// Rows are padded like a driver aligning them to 64 bytes would.
+static const int PADDING = 64;
+
+static bool failed = false;
+
+static void run(const char *p_name, const std::function<bool()> &p_kernel) {
+	const int iterations = 50;
+	if (!p_kernel()) {
+		printf("%-24s rejected its input\n", p_name);
+		failed = true;
+		return;
+	}
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; i++) {
+		p_kernel();
+	}
+	std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+	double frame_usec = elapsed.count() / iterations;
+	printf("%-24s %9.1f usec/frame %7.3f nsec/pixel\n", p_name, frame_usec, frame_usec * 1000.0 / (WIDTH * HEIGHT));
+}
+
+static void check(const char *p_name, bool p_passed) {
+	if (!p_passed) {
+		printf("%s failed\n", p_name);
+		failed = true;
+	}
+}
+
+static bool equals(const std::vector<uint8_t> &p_output, const std::vector<uint8_t> &p_expected) {
+	return memcmp(p_output.data(), p_expected.data(), p_expected.size()) == 0;
+}
+
+// Small frames with hand computed results, wide enough to reach both the SIMD and the scalar code.
+static void check_known_values() {
+	std::vector<uint8_t> output(1024);
+	OutputSpan span = { output.data(), output.size() };
+
+	// Y 100 and 200 with U 192, V 128: red and blue are offset by chroma, green by both.
+	const uint8_t yuyv[] = { 100, 192, 200, 128, 100, 192, 200, 128 };
+	static const int indexes[4] = { 0, 2, 1, 3 };
+	yuyv_row_to_rgb(yuyv, indexes, 2, output.data());
+	check("yuyv_to_rgb values", equals(output, { 100, 76, 229, 200, 176, 255 }));
+	yuyv_row_to_grayscale(yuyv, indexes, 4, output.data());
+	check("yuyv_to_grayscale values", equals(output, { 100, 200, 100, 200 }));
+
+	// Six pixels, four for the SSE2 loop and two for the tail.
+	std::vector<uint8_t> bgrx;
+	for (int i = 0; i < 6; i++) {
+		bgrx.insert(bgrx.end(), { uint8_t(10 + i), 20, uint8_t(30 + i), 0 });
+	}
+	FrameDescriptor bgrx_frame = { bgrx.data(), bgrx.size(), 6, 1, 24 };
+	std::vector<uint8_t> swapped;
+	std::vector<uint8_t> opaque;
+	for (int i = 0; i < 6; i++) {
+		swapped.insert(swapped.end(), { uint8_t(30 + i), 20, uint8_t(10 + i), 255 });
+		opaque.insert(opaque.end(), { uint8_t(10 + i), 20, uint8_t(30 + i), 255 });
+	}
+	check("packed_bgrx values", convert_packed(bgrx_frame, PACKED_BGRX, span) && equals(output, swapped));
+	check("packed_rgbx values", convert_packed(bgrx_frame, PACKED_RGBX, span) && equals(output, opaque));
+	const uint8_t bgr[] = { 1, 2, 3, 4, 5, 6 };
+	check("packed_bgr values", convert_packed({ bgr, 6, 2, 1, 6 }, PACKED_BGR, span) && equals(output, { 3, 2, 1, 6, 5, 4 }));
+
+	const uint8_t gray16[] = { 0x00, 0x00, 0xff, 0xff, 0x00, 0x80 };
+	FrameDescriptor gray16_frame = { gray16, 6, 3, 1, 6 };
+	std::vector<uint8_t> table(65536);
+	for (int i = 0; i < 65536; i++) {
+		table[i] = uint8_t(i >> 8);
+	}
+	check("gray16_to_8 values", convert_gray16(gray16_frame, table.data(), span) && equals(output, { 0, 255, 128 }));
+	check("half_float values", make_half_float(1.0f) == 0x3c00 && make_half_float(0.5f) == 0x3800 && make_half_float(0.0f) == 0);
+
+	// A single RGGB cell, mirrored at every edge.
+	const uint8_t cell[] = { 200, 100, 120, 40 };
+	FrameDescriptor cell_frame = { cell, 4, 2, 2, 2 };
+	check("demosaic_bayer cell", demosaic_bayer(cell_frame, 0, 0, span) && equals(output, { 200, 110, 40, 200, 100, 40, 200, 120, 40, 200, 110, 40 }));
+	check("bin_bayer cell", bin_bayer(cell_frame, 0, 0, span) && equals(output, { 200, 110, 40 }));
+
+	// A flat colour survives interpolation at every pixel, 40 columns cover two SSE2 blocks.
+	std::vector<uint8_t> flat;
+	for (int y = 0; y < 4; y++) {
+		for (int x = 0; x < 40; x++) {
+			flat.push_back((y & 1) != (x & 1) ? 100 : ((y & 1) ? 40 : 200));
+		}
+	}
+	std::vector<uint8_t> flat_rgb;
+	for (int i = 0; i < 40 * 4; i++) {
+		flat_rgb.insert(flat_rgb.end(), { 200, 100, 40 });
+	}
+	check("demosaic_bayer flat", demosaic_bayer({ flat.data(), flat.size(), 40, 4, 40 }, 0, 0, span) && equals(output, flat_rgb));
+}
+
+static FrameDescriptor make_frame(std::vector<uint8_t> &r_data, int p_pixel_size) {
+	int stride = WIDTH * p_pixel_size + PADDING;
+	r_data.resize(size_t(stride) * HEIGHT);
+	for (size_t i = 0; i < r_data.size(); i++) {
+		r_data[i] = uint8_t(i * 7 + (i >> 8));
+	}
+	return { r_data.data(), r_data.size(), WIDTH, HEIGHT, stride };
+}
+
+int main() {
+	std::vector<uint8_t> source;
+	std::vector<uint8_t> output(size_t(WIDTH) * HEIGHT * 4);
+	OutputSpan span = { output.data(), output.size() };
+
+	FrameDescriptor yuyv = make_frame(source, 2);
+	static const int indexes[4] = { 0, 2, 1, 3 };
+	run("yuyv_to_rgb", [&]() {
+		for (int y = 0; y < HEIGHT; y++) {
+			yuyv_row_to_rgb(yuyv.row(y), indexes, WIDTH, output.data() + size_t(y) * WIDTH * 3);
+		}
+		return true;
+	});
+	run("yuyv_to_grayscale", [&]() {
+		for (int y = 0; y < HEIGHT; y++) {
+			yuyv_row_to_grayscale(yuyv.row(y), indexes, WIDTH, output.data() + size_t(y) * WIDTH);
+		}
+		return true;
+	});
+	std::vector<uint8_t> reference(WIDTH);
+	std::vector<uint32_t> block_sums(WIDTH / MOTION_BLOCK_SIZE);
+	run("extract_luma", [&]() {
+		for (int y = 0; y < HEIGHT; y++) {
+			extract_luma_row(yuyv.row(y), 0, WIDTH, output.data() + size_t(y) * WIDTH, reference.data(), block_sums.data());
+		}
+		return true;
+	});
+	run("copy_rows", [&]() { return copy_rows(yuyv, WIDTH * 2, span); });
+
+	std::vector<uint8_t> rgb_source;
+	FrameDescriptor rgb = make_frame(rgb_source, 3);
+	run("packed_rgb", [&]() { return convert_packed(rgb, PACKED_RGB, span); });
+	run("packed_bgr", [&]() { return convert_packed(rgb, PACKED_BGR, span); });
+	std::vector<uint8_t> rgbx_source;
+	FrameDescriptor rgbx = make_frame(rgbx_source, 4);
+	run("packed_bgrx", [&]() { return convert_packed(rgbx, PACKED_BGRX, span); });
+
+	std::vector<uint8_t> gray16_source;
+	FrameDescriptor gray16 = make_frame(gray16_source, 2);
+	std::vector<uint16_t> half_table(65536);
+	for (int i = 0; i < 65536; i++) {
+		half_table[i] = make_half_float(i / 65535.0f);
+	}
+	run("gray16_to_half", [&]() { return convert_gray16(gray16, half_table.data(), span); });
+	run("gray16_to_float", [&]() { return convert_gray16(gray16, 0.0f, 1.0f / 65535.0f, span); });
+
+	std::vector<uint8_t> bayer_source;
+	FrameDescriptor bayer = make_frame(bayer_source, 1);
+	run("demosaic_bayer", [&]() { return demosaic_bayer(bayer, 0, 0, span); });
+	run("bin_bayer", [&]() { return bin_bayer(bayer, 0, 0, span); });
+
+	// A frame missing its last row must be rejected, not read past its end.
+	FrameDescriptor truncated = rgb;
+	truncated.length -= truncated.stride;
+	if (convert_packed(truncated, PACKED_RGB, span)) {
+		printf("truncated frame was accepted\n");
+		failed = true;
+	}
+	check_known_values();
+	return failed ? 1 : 0;
+}
@@ -1,5 +1,6 @@
 #include "camera_feed_android.h"
 
+#include "godot_cpp/classes/time.hpp"
 #include "godot_cpp/core/math.hpp"
 #include "godot_cpp/variant/transform2d.hpp"
 
@@ -68,7 +69,7 @@ void CameraFeedAndroid::set_jpeg_image(jobjectArray p_buffers, int p_rotation) {
 		this_->set_transform(transform);
 		rotation = p_rotation;
 	}
-	decoder->decode(*this->buffer);
+	dispatch_frame(decoder, *this->buffer, 0, Time::get_singleton()->get_ticks_usec());
 	env->ReleaseByteArrayElements(buffer, bytes, 0);
 }
 
@@ -89,9 +90,24 @@ void CameraFeedAndroid::deactivate_feed() {
 	JNIEnv *env = get_jni_env();
 	env->CallVoidMethod(feed, _deactivate);
 	memdelete(decoder);
+	decoder = nullptr;
 }
 
-TypedArray<Dictionary> CameraFeedAndroid::get_formats() const {
+Ref<Image> CameraFeedAndroid::decode_frame(StreamingBuffer p_buffer) {
+	if (decoder == nullptr) {
+		return Ref<Image>();
+	}
+	return decoder->decode_image(p_buffer);
+}
+
+bool CameraFeedAndroid::decode_pending() {
+	if (decoder == nullptr) {
+		return false;
+	}
+	return decoder->decode_pending();
+}
+
+TypedArray<Dictionary> CameraFeedAndroid::get_formats() {
 	TypedArray<Dictionary> formats;
 	JNIEnv *env = get_jni_env();
 	jobjectArray output_formats = (jobjectArray)env->CallObjectMethod(feed, _get_formats);
@@ -33,6 +33,8 @@ private:
 	void set_image(jint p_format, jint p_width, jint p_height, jint p_rotation, jobjectArray p_buffers);
 	void set_jpeg_image(jobjectArray p_buffers, int p_rotation);
 
+	bool decode_pending() override;
+
 public:
 	CameraFeedAndroid(CameraFeedExtension *p_feed);
 	CameraFeedAndroid(jobject p_feed);
@@ -41,9 +43,11 @@ public:
 	bool activate_feed() override;
 	void deactivate_feed() override;
 
-	TypedArray<Dictionary> get_formats() const override;
+	TypedArray<Dictionary> get_formats() override;
 	bool set_format(int p_index, const Dictionary &p_parameters) override;
 
+	Ref<Image> decode_frame(StreamingBuffer p_buffer) override;
+
 	void set_this(CameraFeedExtension *p_feed) override;
 
 	friend JNIEXPORT void JNICALL Java_io_godot_camera_GodotCameraFeed_setup(JNIEnv *env, jclass clazz);
@@ -37,7 +37,7 @@ public:
 	bool activate_feed() override;
 	void deactivate_feed() override;
 
-	TypedArray<Dictionary> get_formats() const override;
+	TypedArray<Dictionary> get_formats() override;
 	bool set_format(int p_index, const Dictionary &p_parameters) override;
 
 	//// Debugging method - comment out when not needed
@@ -203,7 +203,7 @@ void CameraFeedApple::deactivate_feed() {
 	}
 }
 
-TypedArray<Dictionary> CameraFeedApple::get_formats() const {
+TypedArray<Dictionary> CameraFeedApple::get_formats() {
 	TypedArray<Dictionary> formats;
 	for (AVCaptureDeviceFormat *format in device.formats) {
 		Dictionary dictionary;
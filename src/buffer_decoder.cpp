@@ -30,18 +30,214 @@
 
 #include "buffer_decoder.h"
 
+#include "godot_cpp/core/math.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef FFMPEG_ENABLED
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+}
+#endif
+
+#ifdef LIBJPEG_ENABLED
+#include <csetjmp>
+#include <cstdio>
+
+#include <jpeglib.h>
+
+struct JpegErrorManager {
+	jpeg_error_mgr manager;
+	jmp_buf jump;
+};
+
+static void jpeg_error_exit(j_common_ptr p_info) {
+	longjmp(((JpegErrorManager *)p_info->err)->jump, 1);
+}
+#endif
+
 BufferDecoder::BufferDecoder(CameraFeed *p_camera_feed) {
 	camera_feed = p_camera_feed;
 	image.instantiate();
 }
 
+void BufferLease::reference() { refcount.fetch_add(1); }
+
+void BufferLease::unreference() {
+	if (refcount.fetch_sub(1) == 1) {
+		release();
+	}
+}
+
+bool BufferLease::is_shared() const { return refcount.load() > 1; }
+
+BufferDecoder::~BufferDecoder() {
+	std::lock_guard<std::mutex> lock(mutex);
+	release_pending();
+}
+
+void BufferDecoder::release_pending() {
+	if (pending && pending_buffer.lease) {
+		pending_buffer.lease->unreference();
+	}
+	pending_buffer = StreamingBuffer();
+	pending = false;
+}
+
+bool BufferDecoder::requires_every_frame() const { return false; }
+
+void BufferDecoder::skip(StreamingBuffer p_buffer) {}
+
+bool BufferDecoder::submit(StreamingBuffer p_buffer, int p_rotation, bool p_deferred) {
+	if (requires_every_frame()) {
+		std::lock_guard<std::mutex> decode_lock(decode_mutex);
+		if (p_deferred) {
+			skip(p_buffer);
+			return false;
+		}
+		decode(p_buffer, p_rotation);
+		return true;
+	}
+	if (!p_deferred && decode_mutex.try_lock()) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			release_pending();
+		}
+		decode(p_buffer, p_rotation);
+		decode_mutex.unlock();
+		return true;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	release_pending();
+	pending_buffer = p_buffer;
+	if (p_buffer.lease) {
+		p_buffer.lease->reference();
+	} else {
+		if (size_t(pending_data.size()) < p_buffer.length) {
+			pending_data.resize(p_buffer.length);
+		}
+		memcpy(pending_data.ptrw(), p_buffer.start, p_buffer.length);
+		pending_buffer.start = pending_data.ptrw();
+	}
+	pending_rotation = p_rotation;
+	pending = true;
+	return false;
+}
+
+bool BufferDecoder::decode_pending() {
+	std::lock_guard<std::mutex> decode_lock(decode_mutex);
+	StreamingBuffer buffer;
+	int rotation = 0;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!pending) {
+			return false;
+		}
+		buffer = pending_buffer;
+		rotation = pending_rotation;
+		if (buffer.lease == nullptr) {
+			// A frame arriving during the decode is copied into the other buffer.
+			std::swap(pending_data, decoding_data);
+		}
+		// The reference of a leased buffer moves along with it.
+		pending_buffer = StreamingBuffer();
+		pending = false;
+	}
+	decode(buffer, rotation);
+	if (buffer.lease) {
+		buffer.lease->unreference();
+	}
+	return true;
+}
+
+void BufferDecoder::reserve_pending(size_t p_size) {
+	std::lock_guard<std::mutex> decode_lock(decode_mutex);
+	std::lock_guard<std::mutex> lock(mutex);
+	if (size_t(pending_data.size()) < p_size) {
+		pending_data.resize(p_size);
+		if (pending && pending_buffer.lease == nullptr) {
+			pending_buffer.start = pending_data.ptrw();
+		}
+	}
+	if (size_t(decoding_data.size()) < p_size) {
+		decoding_data.resize(p_size);
+	}
+}
+
+void BufferDecoder::detach_pending() {
+	std::lock_guard<std::mutex> decode_lock(decode_mutex);
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!pending || pending_buffer.lease == nullptr) {
+		return;
+	}
+	if (size_t(pending_data.size()) < pending_buffer.length) {
+		pending_data.resize(pending_buffer.length);
+	}
+	memcpy(pending_data.ptrw(), pending_buffer.start, pending_buffer.length);
+	pending_buffer.lease->unreference();
+	pending_buffer.start = pending_data.ptrw();
+	pending_buffer.lease = nullptr;
+}
+
+Ref<Image> BufferDecoder::get_image() const {
+	return image;
+}
+
+Ref<Image> BufferDecoder::decode_image(StreamingBuffer p_buffer) {
+	std::lock_guard<std::mutex> lock(decode_mutex);
+	uint64_t presented = presented_frames;
+	uint64_t unchanged = unchanged_frames;
+	decode_blocking(p_buffer, 0);
+	if (presented_frames == presented && (unchanged_frames == unchanged || presented == 0)) {
+		return Ref<Image>();
+	}
+	return image;
+}
+
+void BufferDecoder::present_image(const Ref<Image> &p_image) {
+	presented_frames++;
+	camera_feed->set_rgb_image(p_image);
+}
+
+void BufferDecoder::keep_image() {
+	unchanged_frames++;
+}
+
+void BufferDecoder::decode_blocking(StreamingBuffer p_buffer, int p_rotation) {
+	decode(p_buffer, p_rotation);
+}
+
+Dictionary BufferDecoder::get_statistics() {
+	std::lock_guard<std::mutex> lock(decode_mutex);
+	return build_statistics();
+}
+
+Dictionary BufferDecoder::build_statistics() const {
+	return Dictionary();
+}
+
+TypedArray<Image> BufferDecoder::get_pyramid() {
+	std::lock_guard<std::mutex> lock(decode_mutex);
+	return build_pyramid();
+}
+
+TypedArray<Image> BufferDecoder::build_pyramid() const {
+	return TypedArray<Image>();
+}
+
 void BufferDecoder::rotate_image(int p_rotation) {
+	rotate_image(image, p_rotation);
+}
+
+void BufferDecoder::rotate_image(const Ref<Image> &p_image, int p_rotation) {
 	if (p_rotation == 90) {
-		image->rotate_90(ClockDirection::CLOCKWISE);
+		p_image->rotate_90(ClockDirection::CLOCKWISE);
 	} else if (p_rotation == 270) {
-		image->rotate_90(ClockDirection::COUNTERCLOCKWISE);
+		p_image->rotate_90(ClockDirection::COUNTERCLOCKWISE);
 	} else if (p_rotation == 180) {
-		image->rotate_180();
+		p_image->rotate_180();
 	}
 }
 
@@ -50,30 +246,221 @@ AbstractYuyvBufferDecoder::AbstractYuyvBufferDecoder(CameraFeed *p_camera_feed,
 	width = p_width;
 	height = p_height;
 	component_indexes = p_component_indexes;
+
+	tile_columns.resize(width / 2);
+	for (int i = 0; i < width / 2; i++) {
+		tile_columns.set(i, i * 2 * STATISTICS_TILES / width);
+	}
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width / 2; x++) {
+			tile_pixels[(y * STATISTICS_TILES / height) * STATISTICS_TILES + tile_columns[x]] += 2;
+		}
+	}
 }
 
 AbstractYuyvBufferDecoder::~AbstractYuyvBufferDecoder() {
 	delete[] component_indexes;
 }
 
+void AbstractYuyvBufferDecoder::set_statistics_enabled(bool p_enabled) {
+	statistics_enabled = p_enabled;
+}
+
+void AbstractYuyvBufferDecoder::set_motion_threshold(int p_threshold) {
+	motion_threshold = p_threshold;
+	if (motion_threshold <= 0) {
+		luma[0].clear();
+		luma[1].clear();
+		motion_map.clear();
+		reference_luma = -1;
+		return;
+	}
+	motion_columns = (width + MOTION_BLOCK_SIZE - 1) / MOTION_BLOCK_SIZE;
+	motion_rows = (height + MOTION_BLOCK_SIZE - 1) / MOTION_BLOCK_SIZE;
+	luma[0].resize(width * height);
+	luma[1].resize(width * height);
+	motion_map.resize(motion_columns * motion_rows);
+	motion_map.fill(0);
+	block_sums.resize(motion_columns);
+}
+
+bool AbstractYuyvBufferDecoder::detect_motion(const frame_kernels::FrameDescriptor &p_frame) {
+	int current = reference_luma == 0 ? 1 : 0;
+	uint8_t *dst = luma[current].ptrw();
+	const uint8_t *reference = reference_luma == -1 ? nullptr : luma[reference_luma].ptr();
+	uint8_t *map = motion_map.ptrw();
+	// Luma is at even bytes for YUY2/YVYU and at odd bytes for UYVY/VYUY.
+	int offset = component_indexes[0] & 1;
+	int changed_blocks = 0;
+
+	for (int y = 0; y < height; y++) {
+		if (y % MOTION_BLOCK_SIZE == 0) {
+			std::fill(block_sums.begin(), block_sums.end(), 0);
+		}
+		frame_kernels::extract_luma_row(p_frame.row(y), offset, width, dst + y * width, reference ? reference + y * width : nullptr, block_sums.data());
+		if (reference && (y % MOTION_BLOCK_SIZE == MOTION_BLOCK_SIZE - 1 || y == height - 1)) {
+			int block_height = y % MOTION_BLOCK_SIZE + 1;
+			for (int i = 0; i < motion_columns; i++) {
+				int block_width = MIN(MOTION_BLOCK_SIZE, width - i * MOTION_BLOCK_SIZE);
+				uint32_t mean = block_sums[i] / (block_width * block_height);
+				map[(y / MOTION_BLOCK_SIZE) * motion_columns + i] = MIN(mean, 255u);
+				if (int(mean) >= motion_threshold) {
+					changed_blocks++;
+				}
+			}
+		}
+	}
+
+	if (reference && changed_blocks == 0) {
+		return false;
+	}
+	// The reference only moves on converted frames, so slow drift still adds up to motion.
+	reference_luma = current;
+	if (reference) {
+		camera_feed->call_deferred("emit_signal", "motion_detected", motion_map, changed_blocks);
+	}
+	return true;
+}
+
+void AbstractYuyvBufferDecoder::set_pyramid_levels(int p_levels) {
+	pyramid_levels = CLAMP(p_levels, 0, PYRAMID_MAX_LEVELS);
+	for (int i = 0; i < PYRAMID_MAX_LEVELS; i++) {
+		if (i < pyramid_levels) {
+			pyramid_data[i].resize((width >> (i + 1)) * (height >> (i + 1)) * channels);
+			pyramid_images[i].instantiate();
+		} else {
+			pyramid_data[i].clear();
+			pyramid_images[i].unref();
+		}
+	}
+}
+
+TypedArray<Image> AbstractYuyvBufferDecoder::build_pyramid() const {
+	TypedArray<Image> pyramid;
+	// Copies, the level images are overwritten by the next frame.
+	for (int i = 0; i < pyramid_levels; i++) {
+		if (!pyramid_images[i]->is_empty()) {
+			pyramid.push_back(pyramid_images[i]->duplicate());
+		}
+	}
+	return pyramid;
+}
+
+void AbstractYuyvBufferDecoder::downsample_row(int p_level, const uint8_t *p_src, int p_channels, int p_y) {
+	if (p_level > pyramid_levels || (p_y & 1) == 0) {
+		return;
+	}
+	int src_width = width >> (p_level - 1);
+	int dst_width = width >> p_level;
+	int dst_y = p_y >> 1;
+	if (dst_y >= height >> p_level) {
+		return;
+	}
+	const uint8_t *row0 = p_src + (p_y - 1) * src_width * p_channels;
+	const uint8_t *row1 = row0 + src_width * p_channels;
+	uint8_t *level = pyramid_data[p_level - 1].ptrw();
+	frame_kernels::downsample_rows(row0, row1, dst_width, p_channels, level + dst_y * dst_width * p_channels);
+	downsample_row(p_level + 1, level, p_channels, dst_y);
+}
+
+void AbstractYuyvBufferDecoder::update_pyramid_images() {
+	for (int i = 0; i < pyramid_levels; i++) {
+		int level_width = width >> (i + 1);
+		int level_height = height >> (i + 1);
+		if (level_width == 0 || level_height == 0) {
+			break;
+		}
+		pyramid_images[i]->set_data(level_width, level_height, false, channels == 1 ? Image::FORMAT_L8 : Image::FORMAT_RGB8, pyramid_data[i]);
+	}
+}
+
+void AbstractYuyvBufferDecoder::accumulate_row(const uint8_t *p_src, int p_y) {
+	const uint8_t *y0_src = p_src + component_indexes[0];
+	const uint8_t *y1_src = p_src + component_indexes[1];
+	const uint8_t *columns = tile_columns.ptr();
+	uint32_t *tile_row = tile_sums + (p_y * STATISTICS_TILES / height) * STATISTICS_TILES;
+	for (int x = 0; x < width / 2; x++) {
+		uint8_t y0 = y0_src[x * 4];
+		uint8_t y1 = y1_src[x * 4];
+		histogram[0][y0]++;
+		histogram[1][y1]++;
+		luma_min = MIN(luma_min, MIN(y0, y1));
+		luma_max = MAX(luma_max, MAX(y0, y1));
+		tile_row[columns[x]] += y0 + y1;
+	}
+}
+
+void AbstractYuyvBufferDecoder::reset_statistics() {
+	memset(histogram, 0, sizeof(histogram));
+	memset(tile_sums, 0, sizeof(tile_sums));
+	luma_min = 255;
+	luma_max = 0;
+}
+
+Dictionary AbstractYuyvBufferDecoder::build_statistics() const {
+	Dictionary statistics;
+	if (motion_threshold > 0) {
+		statistics["motion_map"] = motion_map;
+		statistics["motion_columns"] = motion_columns;
+		statistics["motion_rows"] = motion_rows;
+	}
+	if (!statistics_enabled) {
+		return statistics;
+	}
+	PackedInt32Array luma_histogram;
+	luma_histogram.resize(256);
+	uint64_t sum = 0;
+	for (int i = 0; i < 256; i++) {
+		uint32_t count = histogram[0][i] + histogram[1][i];
+		luma_histogram.set(i, count);
+		sum += uint64_t(count) * i;
+	}
+	PackedFloat32Array tiles;
+	tiles.resize(STATISTICS_TILES * STATISTICS_TILES);
+	for (int i = 0; i < STATISTICS_TILES * STATISTICS_TILES; i++) {
+		tiles.set(i, tile_pixels[i] ? float(tile_sums[i]) / tile_pixels[i] : 0.0f);
+	}
+	statistics["histogram"] = luma_histogram;
+	statistics["mean"] = width * height ? double(sum) / (width * height) : 0.0;
+	statistics["min"] = luma_min;
+	statistics["max"] = luma_max;
+	statistics["tiles"] = tiles;
+	statistics["tile_columns"] = STATISTICS_TILES;
+	statistics["tile_rows"] = STATISTICS_TILES;
+	return statistics;
+}
+
 YuyvToGrayscaleBufferDecoder::YuyvToGrayscaleBufferDecoder(CameraFeed *p_camera_feed, int p_width, int p_height, int *p_component_indexes) :
 		AbstractYuyvBufferDecoder(p_camera_feed, p_width, p_height, p_component_indexes) {
+	channels = 1;
 	image_data.resize(width * height);
 }
 
 void YuyvToGrayscaleBufferDecoder::decode(StreamingBuffer p_buffer, int p_rotation) {
+	frame_kernels::FrameDescriptor frame = { (const uint8_t *)p_buffer.start, p_buffer.length, width, height, p_buffer.get_stride(width * 2) };
 	uint8_t *dst = (uint8_t *)image_data.ptrw();
-	uint8_t *src = (uint8_t *)p_buffer.start;
-	uint8_t *y0_src = src + component_indexes[0];
-	uint8_t *y1_src = src + component_indexes[1];
-
-	for (int i = 0; i < width * height; i += 2) {
-		*dst++ = *y0_src;
-		*dst++ = *y1_src;
+	if (!frame.covers(width * 2)) {
+		return;
+	}
 
-		y0_src += 4;
-		y1_src += 4;
+	if (motion_threshold > 0 && !detect_motion(frame)) {
+		// Nothing moved, the current image and its texture stay as they are.
+		keep_image();
+		return;
 	}
+	if (statistics_enabled) {
+		reset_statistics();
+	}
+	for (int y = 0; y < height; y++) {
+		frame_kernels::yuyv_row_to_grayscale(frame.row(y), component_indexes, width, dst + y * width);
+		if (statistics_enabled) {
+			accumulate_row(frame.row(y), y);
+		}
+		if (pyramid_levels > 0) {
+			downsample_row(1, dst, channels, y);
+		}
+	}
+	update_pyramid_images();
 
 	if (image.is_valid()) {
 		image->set_data(width, height, false, Image::FORMAT_L8, image_data);
@@ -84,7 +471,7 @@ void YuyvToGrayscaleBufferDecoder::decode(StreamingBuffer p_buffer, int p_rotati
 
 	rotate_image(p_rotation);
 
-	camera_feed->set_rgb_image(image);
+	present_image(image);
 }
 
 YuyvToRgbBufferDecoder::YuyvToRgbBufferDecoder(CameraFeed *p_camera_feed, int p_width, int p_height, int *p_component_indexes) :
@@ -93,33 +480,30 @@ YuyvToRgbBufferDecoder::YuyvToRgbBufferDecoder(CameraFeed *p_camera_feed, int p_
 }
 
 void YuyvToRgbBufferDecoder::decode(StreamingBuffer p_buffer, int p_rotation) {
-	uint8_t *src = (uint8_t *)p_buffer.start;
-	uint8_t *y0_src = src + component_indexes[0];
-	uint8_t *y1_src = src + component_indexes[1];
-	uint8_t *u_src = src + component_indexes[2];
-	uint8_t *v_src = src + component_indexes[3];
+	frame_kernels::FrameDescriptor frame = { (const uint8_t *)p_buffer.start, p_buffer.length, width, height, p_buffer.get_stride(width * 2) };
 	uint8_t *dst = (uint8_t *)image_data.ptrw();
+	if (!frame.covers(width * 2)) {
+		return;
+	}
 
-	for (int i = 0; i < width * height; i += 2) {
-		int u = *u_src;
-		int v = *v_src;
-		int u1 = (((u - 128) << 7) + (u - 128)) >> 6;
-		int rg = (((u - 128) << 1) + (u - 128) + ((v - 128) << 2) + ((v - 128) << 1)) >> 3;
-		int v1 = (((v - 128) << 1) + (v - 128)) >> 1;
-
-		*dst++ = CLAMP(*y0_src + v1, 0, 255);
-		*dst++ = CLAMP(*y0_src - rg, 0, 255);
-		*dst++ = CLAMP(*y0_src + u1, 0, 255);
-
-		*dst++ = CLAMP(*y1_src + v1, 0, 255);
-		*dst++ = CLAMP(*y1_src - rg, 0, 255);
-		*dst++ = CLAMP(*y1_src + u1, 0, 255);
-
-		y0_src += 4;
-		y1_src += 4;
-		u_src += 4;
-		v_src += 4;
+	if (motion_threshold > 0 && !detect_motion(frame)) {
+		// Nothing moved, the current image and its texture stay as they are.
+		keep_image();
+		return;
 	}
+	if (statistics_enabled) {
+		reset_statistics();
+	}
+	for (int y = 0; y < height; y++) {
+		frame_kernels::yuyv_row_to_rgb(frame.row(y), component_indexes, width, dst + y * width * 3);
+		if (statistics_enabled) {
+			accumulate_row(frame.row(y), y);
+		}
+		if (pyramid_levels > 0) {
+			downsample_row(1, dst, channels, y);
+		}
+	}
+	update_pyramid_images();
 
 	if (image.is_valid()) {
 		image->set_data(width, height, false, Image::FORMAT_RGB8, image_data);
@@ -130,7 +514,7 @@ void YuyvToRgbBufferDecoder::decode(StreamingBuffer p_buffer, int p_rotation) {
 
 	rotate_image(p_rotation);
 
-	camera_feed->set_rgb_image(image);
+	present_image(image);
 }
 
 CopyBufferDecoder::CopyBufferDecoder(CameraFeed *p_camera_feed, int p_width, int p_height, bool p_rgba) :
@@ -142,8 +526,11 @@ CopyBufferDecoder::CopyBufferDecoder(CameraFeed *p_camera_feed, int p_width, int
 }
 
 void CopyBufferDecoder::decode(StreamingBuffer p_buffer, int p_rotation) {
-	uint8_t *dst = (uint8_t *)image_data.ptrw();
-	memcpy(dst, p_buffer.start, p_buffer.length);
+	int row_size = width * (rgba ? 4 : 2);
+	frame_kernels::FrameDescriptor frame = { (const uint8_t *)p_buffer.start, p_buffer.length, width, height, p_buffer.get_stride(row_size) };
+	if (!frame_kernels::copy_rows(frame, row_size, { image_data.ptrw(), size_t(image_data.size()) })) {
+		return;
+	}
 
 	if (image.is_valid()) {
 		image->set_data(width, height, false, rgba ? Image::FORMAT_RGBA8 : Image::FORMAT_LA8, image_data);
@@ -154,19 +541,389 @@ void CopyBufferDecoder::decode(StreamingBuffer p_buffer, int p_rotation) {
 
 	rotate_image(p_rotation);
 
-	camera_feed->set_rgb_image(image);
+	present_image(image);
 }
 
-JpegBufferDecoder::JpegBufferDecoder(CameraFeed *p_camera_feed) :
+PackedBufferDecoder::PackedBufferDecoder(CameraFeed *p_camera_feed, int p_width, int p_height, Layout p_layout) :
 		BufferDecoder(p_camera_feed) {
+	width = p_width;
+	height = p_height;
+	layout = p_layout;
+	image_data.resize(width * height * frame_kernels::get_packed_pixel_size(frame_kernels::PackedLayout(layout)));
+}
+
+void PackedBufferDecoder::decode(StreamingBuffer p_buffer, int p_rotation) {
+	if (height == 0) {
+		return;
+	}
+	// Rows may be padded, e.g. to keep 3 byte pixels aligned.
+	int row_size = width * frame_kernels::get_packed_pixel_size(frame_kernels::PackedLayout(layout));
+	frame_kernels::FrameDescriptor frame = { (const uint8_t *)p_buffer.start, p_buffer.length, width, height, p_buffer.get_stride(row_size) };
+	if (!frame_kernels::convert_packed(frame, frame_kernels::PackedLayout(layout), { image_data.ptrw(), size_t(image_data.size()) })) {
+		return;
+	}
+	Image::Format format = Image::FORMAT_RGB8;
+	if (layout == LAYOUT_GRAY8) {
+		format = Image::FORMAT_L8;
+	} else if (layout == LAYOUT_RGBX || layout == LAYOUT_BGRX) {
+		format = Image::FORMAT_RGBA8;
+	}
+
+	image->set_data(width, height, false, format, image_data);
+
+	rotate_image(p_rotation);
+
+	present_image(image);
+}
+
+Gray16BufferDecoder::Gray16BufferDecoder(CameraFeed *p_camera_feed, int p_width, int p_height, Mode p_mode, int p_range_min, int p_range_max) :
+		BufferDecoder(p_camera_feed) {
+	width = p_width;
+	height = p_height;
+	mode = p_mode;
+	range_min = p_range_min;
+	range_scale = p_range_max > p_range_min ? 1.0f / (p_range_max - p_range_min) : 1.0f;
+	switch (mode) {
+		case MODE_HALF:
+			image_data.resize(width * height * 2);
+			half_table.resize(65536);
+			for (int i = 0; i < 65536; i++) {
+				half_table[i] = frame_kernels::make_half_float((i - range_min) * range_scale);
+			}
+			break;
+		case MODE_FLOAT:
+			image_data.resize(width * height * 4);
+			break;
+		case MODE_L8:
+			image_data.resize(width * height);
+			l8_table.resize(65536);
+			for (int i = 0; i < 65536; i++) {
+				l8_table[i] = CLAMP(int((i - range_min) * range_scale * 255.0f + 0.5f), 0, 255);
+			}
+			break;
+		default:
+			image_data.resize(width * height * 2);
+			break;
+	}
+}
+
+void Gray16BufferDecoder::decode(StreamingBuffer p_buffer, int p_rotation) {
+	frame_kernels::FrameDescriptor frame = { (const uint8_t *)p_buffer.start, p_buffer.length, width, height, p_buffer.get_stride(width * 2) };
+	frame_kernels::OutputSpan output = { image_data.ptrw(), size_t(image_data.size()) };
+	bool converted = false;
+	Image::Format format = Image::FORMAT_RG8;
+	switch (mode) {
+		case MODE_HALF:
+			converted = frame_kernels::convert_gray16(frame, half_table.data(), output);
+			format = Image::FORMAT_RH;
+			break;
+		case MODE_FLOAT:
+			converted = frame_kernels::convert_gray16(frame, range_min, range_scale, output);
+			format = Image::FORMAT_RF;
+			break;
+		case MODE_L8:
+			converted = frame_kernels::convert_gray16(frame, l8_table.data(), output);
+			format = Image::FORMAT_L8;
+			break;
+		default:
+			converted = frame_kernels::copy_rows(frame, width * 2, output);
+			break;
+	}
+	if (!converted) {
+		return;
+	}
+
+	image->set_data(width, height, false, format, image_data);
+
+	rotate_image(p_rotation);
+
+	present_image(image);
+}
+
+BayerBufferDecoder::BayerBufferDecoder(CameraFeed *p_camera_feed, int p_width, int p_height, int p_red_x, int p_red_y, bool p_binning) :
+		BufferDecoder(p_camera_feed) {
+	width = p_width;
+	height = p_height;
+	red_x = p_red_x & 1;
+	red_y = p_red_y & 1;
+	binning = p_binning;
+	if (binning) {
+		image_data.resize((width / 2) * (height / 2) * 3);
+	} else {
+		image_data.resize(width * height * 3);
+	}
+}
+
+void BayerBufferDecoder::decode(StreamingBuffer p_buffer, int p_rotation) {
+	frame_kernels::FrameDescriptor frame = { (const uint8_t *)p_buffer.start, p_buffer.length, width, height, p_buffer.get_stride(width) };
+	frame_kernels::OutputSpan output = { image_data.ptrw(), size_t(image_data.size()) };
+	if (binning) {
+		if (!frame_kernels::bin_bayer(frame, red_x, red_y, output)) {
+			return;
+		}
+		image->set_data(width / 2, height / 2, false, Image::FORMAT_RGB8, image_data);
+	} else {
+		if (!frame_kernels::demosaic_bayer(frame, red_x, red_y, output)) {
+			return;
+		}
+		image->set_data(width, height, false, Image::FORMAT_RGB8, image_data);
+	}
+
+	rotate_image(p_rotation);
+
+	present_image(image);
+}
+
+JpegBufferDecoder::JpegBufferDecoder(CameraFeed *p_camera_feed, int p_threads) :
+		BufferDecoder(p_camera_feed) {
+	if (p_threads <= 1) {
+		return;
+	}
+	jobs.resize(p_threads + 1);
+	for (Job &job : jobs) {
+		job.image.instantiate();
+		free_jobs.push_back(&job);
+	}
+	for (int i = 0; i < p_threads; i++) {
+		workers.emplace_back(&JpegBufferDecoder::worker_main, this);
+	}
+}
+
+JpegBufferDecoder::~JpegBufferDecoder() {
+	{
+		std::lock_guard<std::mutex> lock(jobs_mutex);
+		exiting = true;
+	}
+	jobs_condition.notify_all();
+	for (std::thread &worker : workers) {
+		worker.join();
+	}
 }
 
 void JpegBufferDecoder::decode(StreamingBuffer p_buffer, int p_rotation) {
+	if (workers.empty()) {
+		decode_blocking(p_buffer, p_rotation);
+		return;
+	}
+	std::unique_lock<std::mutex> lock(jobs_mutex);
+	Job *job = nullptr;
+	if (!free_jobs.empty()) {
+		job = free_jobs.back();
+		free_jobs.pop_back();
+	} else if (!queued_jobs.empty()) {
+		// Bounded latency, a newer frame replaces the oldest one that has not started decoding.
+		job = queued_jobs.front();
+		queued_jobs.pop_front();
+		pipeline.erase(std::find(pipeline.begin(), pipeline.end(), job));
+	} else {
+		// Every worker is busy and nothing can be replaced.
+		return;
+	}
+	job->data.resize(p_buffer.length);
+	memcpy(job->data.ptrw(), p_buffer.start, p_buffer.length);
+	job->rotation = p_rotation;
+	job->decoded = false;
+	job->valid = false;
+	pipeline.push_back(job);
+	queued_jobs.push_back(job);
+	lock.unlock();
+	jobs_condition.notify_one();
+}
+
+void JpegBufferDecoder::decode_blocking(StreamingBuffer p_buffer, int p_rotation) {
 	image_data.resize(p_buffer.length);
 	uint8_t *dst = (uint8_t *)image_data.ptrw();
 	memcpy(dst, p_buffer.start, p_buffer.length);
-	if (image->load_jpg_from_buffer(image_data) == OK) {
+	if (decode_jpeg(image_data, pixels, image)) {
 		rotate_image(p_rotation);
-		camera_feed->set_rgb_image(image);
+		present_image(image);
 	}
 }
+
+int JpegBufferDecoder::get_scale_denominator(int p_width, int p_height, int p_target_width, int p_target_height) {
+	if (p_target_width <= 0 && p_target_height <= 0) {
+		return 1;
+	}
+	for (int denominator = 8; denominator > 1; denominator /= 2) {
+		if (p_width / denominator >= p_target_width && p_height / denominator >= p_target_height) {
+			return denominator;
+		}
+	}
+	return 1;
+}
+
+void JpegBufferDecoder::set_target_size(int p_width, int p_height) {
+	target_width = p_width;
+	target_height = p_height;
+}
+
+bool JpegBufferDecoder::decode_jpeg(const PackedByteArray &p_data, PackedByteArray &r_pixels, const Ref<Image> &p_image) const {
+#ifdef LIBJPEG_ENABLED
+	jpeg_decompress_struct info;
+	JpegErrorManager error;
+	info.err = jpeg_std_error(&error.manager);
+	error.manager.error_exit = jpeg_error_exit;
+	if (setjmp(error.jump)) {
+		jpeg_destroy_decompress(&info);
+		return false;
+	}
+	jpeg_create_decompress(&info);
+	jpeg_mem_src(&info, (unsigned char *)p_data.ptr(), p_data.size());
+	jpeg_read_header(&info, TRUE);
+	info.out_color_space = JCS_RGB;
+	// Only the DCT coefficients needed for the smaller size are decoded.
+	info.scale_num = 1;
+	info.scale_denom = get_scale_denominator(info.image_width, info.image_height, target_width, target_height);
+	jpeg_start_decompress(&info);
+	int width = info.output_width;
+	int height = info.output_height;
+	r_pixels.resize(width * height * 3);
+	uint8_t *dst = r_pixels.ptrw();
+	while (info.output_scanline < info.output_height) {
+		JSAMPROW row = dst + info.output_scanline * width * 3;
+		jpeg_read_scanlines(&info, &row, 1);
+	}
+	jpeg_finish_decompress(&info);
+	jpeg_destroy_decompress(&info);
+	p_image->set_data(width, height, false, Image::FORMAT_RGB8, r_pixels);
+	return true;
+#else
+	if (p_image->load_jpg_from_buffer(p_data) != OK) {
+		return false;
+	}
+	int denominator = get_scale_denominator(p_image->get_width(), p_image->get_height(), target_width, target_height);
+	if (denominator > 1) {
+		p_image->resize(p_image->get_width() / denominator, p_image->get_height() / denominator, Image::INTERPOLATE_BILINEAR);
+	}
+	return true;
+#endif
+}
+
+void JpegBufferDecoder::worker_main() {
+	std::unique_lock<std::mutex> lock(jobs_mutex);
+	while (true) {
+		jobs_condition.wait(lock, [this] { return exiting || !queued_jobs.empty(); });
+		if (exiting) {
+			return;
+		}
+		Job *job = queued_jobs.front();
+		queued_jobs.pop_front();
+		lock.unlock();
+		bool valid = decode_jpeg(job->data, job->pixels, job->image);
+		if (valid) {
+			rotate_image(job->image, job->rotation);
+		}
+		lock.lock();
+		job->valid = valid;
+		job->decoded = true;
+		deliver_decoded();
+	}
+}
+
+void JpegBufferDecoder::deliver_decoded() {
+	// A frame is only presented once every older frame has been decoded.
+	while (!pipeline.empty() && pipeline.front()->decoded) {
+		Job *job = pipeline.front();
+		pipeline.pop_front();
+		if (job->valid) {
+			present_image(job->image);
+		}
+		free_jobs.push_back(job);
+	}
+}
+
+#ifdef FFMPEG_ENABLED
+H264BufferDecoder::H264BufferDecoder(CameraFeed *p_camera_feed, int p_threads, bool p_low_latency) :
+		BufferDecoder(p_camera_feed) {
+	const AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+	if (codec == nullptr) {
+		return;
+	}
+	context = avcodec_alloc_context3(codec);
+	if (context == nullptr) {
+		return;
+	}
+	context->thread_count = p_threads;
+	if (p_low_latency) {
+		// Frames are output as soon as they are decoded, libavcodec then only uses slice threads.
+		context->flags |= AV_CODEC_FLAG_LOW_DELAY;
+		context->thread_type = FF_THREAD_SLICE;
+	} else {
+		context->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+	}
+	if (avcodec_open2(context, codec, nullptr) < 0) {
+		avcodec_free_context(&context);
+		return;
+	}
+	frame = av_frame_alloc();
+	packet = av_packet_alloc();
+}
+
+H264BufferDecoder::~H264BufferDecoder() {
+	sws_freeContext(scaler);
+	av_packet_free(&packet);
+	av_frame_free(&frame);
+	avcodec_free_context(&context);
+}
+
+bool H264BufferDecoder::is_valid() const {
+	return context != nullptr && frame != nullptr && packet != nullptr;
+}
+
+bool H264BufferDecoder::requires_every_frame() const { return true; }
+
+bool H264BufferDecoder::send_packet(StreamingBuffer p_buffer) {
+	if (!is_valid()) {
+		return false;
+	}
+	packet_data.resize(p_buffer.length + AV_INPUT_BUFFER_PADDING_SIZE);
+	uint8_t *data = packet_data.ptrw();
+	memcpy(data, p_buffer.start, p_buffer.length);
+	memset(data + p_buffer.length, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+	packet->data = data;
+	packet->size = p_buffer.length;
+	return avcodec_send_packet(context, packet) >= 0;
+}
+
+void H264BufferDecoder::skip(StreamingBuffer p_buffer) {
+	if (!send_packet(p_buffer)) {
+		return;
+	}
+	// Decoded to keep the references intact, only the conversion is left out.
+	while (avcodec_receive_frame(context, frame) == 0) {
+		av_frame_unref(frame);
+	}
+}
+
+void H264BufferDecoder::decode(StreamingBuffer p_buffer, int p_rotation) {
+	if (!send_packet(p_buffer)) {
+		return;
+	}
+
+	bool decoded = false;
+	while (avcodec_receive_frame(context, frame) == 0) {
+		// A packet usually completes one frame, if there are more only the last one is presented.
+		decoded = true;
+		width = frame->width;
+		height = frame->height;
+		scaler = sws_getCachedContext(scaler, width, height, AVPixelFormat(frame->format),
+				width, height, AV_PIX_FMT_RGB24, SWS_BILINEAR, nullptr, nullptr, nullptr);
+		if (scaler == nullptr) {
+			av_frame_unref(frame);
+			return;
+		}
+		image_data.resize(width * height * 3);
+		uint8_t *dst[1] = { image_data.ptrw() };
+		int dst_stride[1] = { width * 3 };
+		sws_scale(scaler, frame->data, frame->linesize, 0, height, dst, dst_stride);
+		av_frame_unref(frame);
+	}
+	if (!decoded) {
+		return;
+	}
+
+	image->set_data(width, height, false, Image::FORMAT_RGB8, image_data);
+	rotate_image(p_rotation);
+	present_image(image);
+}
+#endif
@@ -31,19 +31,88 @@
 #ifndef BUFFER_DECODER_H
 #define BUFFER_DECODER_H
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "godot_cpp/classes/camera_feed.hpp"
 #include "godot_cpp/classes/image.hpp"
 #include "godot_cpp/classes/ref.hpp"
+#include "godot_cpp/variant/typed_array.hpp"
+
+#include "core/frame_kernels.h"
 
 using namespace godot;
 
+// Keeps the memory behind a StreamingBuffer valid after the capture callback returns. The
+// backend gets the buffer back once the last reference is released, from whichever thread.
+// A backend tearing down its buffers (e.g. on renegotiation) detaches decoders first, the lease
+// object itself stays valid until its last reference is released.
+class BufferLease {
+private:
+	std::atomic<int> refcount = 0;
+
+protected:
+	virtual void release() = 0;
+
+public:
+	void reference();
+	void unreference();
+	bool is_shared() const;
+
+	virtual ~BufferLease() {}
+};
+
 struct StreamingBuffer {
 	void *start = nullptr;
 	size_t length = 0;
+	// Bytes from one row to the next as reported by the backend, zero if unknown.
+	int stride = 0;
+	// Set when the memory can be read in place beyond the callback.
+	BufferLease *lease = nullptr;
+
+	// The reported stride, or unpadded rows of p_row_size bytes.
+	int get_stride(int p_row_size) const { return stride > 0 ? stride : p_row_size; }
 };
 
+// Decoders adapt the Godot independent kernels in core/ to CameraFeed, Image and PackedByteArray.
+// Each decoder declares COST_PER_PIXEL, its cost of decoding one pixel relative to
+// YuyvToRgbBufferDecoder, which backends use to rank formats by decode cost.
 class BufferDecoder {
+private:
+	// Guards the pending frame, only held briefly so capture threads never wait for a decode.
+	std::mutex mutex;
+	// Serializes decoding and the readers of decoder state, taken before mutex.
+	std::mutex decode_mutex;
+	// Copies of buffers without a lease, one pending and one being decoded. They only grow.
+	PackedByteArray pending_data;
+	PackedByteArray decoding_data;
+	StreamingBuffer pending_buffer;
+	int pending_rotation = 0;
+	bool pending = false;
+	// Frames handed to the feed, tells decode_image() whether the buffer produced one.
+	std::atomic<uint64_t> presented_frames = 0;
+	// Frames left unconverted because they match the current image, guarded by decode_mutex.
+	uint64_t unchanged_frames = 0;
+
+	void release_pending();
+
 protected:
+	// Decodes into image before returning, for decoders whose decode() finishes asynchronously.
+	virtual void decode_blocking(StreamingBuffer p_buffer, int p_rotation);
+	// Called with the decoder locked, so it never races a decode.
+	virtual Dictionary build_statistics() const;
+	virtual TypedArray<Image> build_pyramid() const;
+	// Hands a decoded frame to the feed.
+	void present_image(const Ref<Image> &p_image);
+	// Records a frame that still looks like the current image, e.g. without motion.
+	void keep_image();
+	// Feeds a frame to a decoder that requires every frame, without converting or presenting it.
+	virtual void skip(StreamingBuffer p_buffer);
+
 	CameraFeed *camera_feed = nullptr;
 	Ref<Image> image;
 	int width = 0;
@@ -51,20 +120,94 @@ protected:
 
 public:
 	virtual void decode(StreamingBuffer p_buffer, int p_rotation = 0) = 0;
+	// Inter-coded streams reference earlier frames, dropping one corrupts the picture until the next
+	// key frame. Such decoders see every frame in order, submit() never replaces or drops one.
+	virtual bool requires_every_frame() const;
 
 	BufferDecoder(CameraFeed *p_camera_feed);
-	virtual ~BufferDecoder() {}
+	virtual ~BufferDecoder();
+
+	// Decodes the buffer right away and returns true, or keeps it for decode_pending() when deferred
+	// or while another thread is decoding. Leased buffers are kept in place, others are copied.
+	// Decoders requiring every frame decode it right away, a deferred one only with skip().
+	bool submit(StreamingBuffer p_buffer, int p_rotation = 0, bool p_deferred = false);
+	// Takes the pending frame and decodes it without blocking submit().
+	bool decode_pending();
+	// Grows the copies of buffers without a lease up front, so submitting never allocates.
+	void reserve_pending(size_t p_size);
+	// Copies a pending leased buffer and releases the lease, for when the backend has to reclaim it.
+	// Waits for a decode in progress, which may still be reading a leased buffer.
+	void detach_pending();
 
+	Ref<Image> get_image() const;
+	// Decodes the buffer on the calling thread and returns the image, which the next decode
+	// overwrites. A frame skipped without motion returns the previous image. Null if the buffer
+	// did not produce a frame, e.g. truncated.
+	Ref<Image> decode_image(StreamingBuffer p_buffer);
+	// Statistics of the last decoded frame, empty if the decoder does not collect any.
+	Dictionary get_statistics();
+	// Downscaled levels of the last decoded frame, empty if the decoder does not build any.
+	TypedArray<Image> get_pyramid();
 	void rotate_image(int p_rotation);
+	static void rotate_image(const Ref<Image> &p_image, int p_rotation);
 };
 
 class AbstractYuyvBufferDecoder : public BufferDecoder {
+public:
+	static constexpr int STATISTICS_TILES = 8;
+	static constexpr int MOTION_BLOCK_SIZE = frame_kernels::MOTION_BLOCK_SIZE;
+	static constexpr int PYRAMID_MAX_LEVELS = 3;
+
 protected:
 	int *component_indexes = nullptr;
+	// Bytes per output pixel.
+	int channels = 3;
+	bool statistics_enabled = false;
+	// Two histogram banks, so runs of equal samples do not serialize on one counter.
+	uint32_t histogram[2][256] = {};
+	uint32_t tile_sums[STATISTICS_TILES * STATISTICS_TILES] = {};
+	uint32_t tile_pixels[STATISTICS_TILES * STATISTICS_TILES] = {};
+	uint8_t luma_min = 0;
+	uint8_t luma_max = 0;
+	// Tile column of each pixel pair.
+	PackedByteArray tile_columns;
+	// Zero disables motion detection.
+	int motion_threshold = 0;
+	// Luma of the frame being decoded and of the last converted frame.
+	PackedByteArray luma[2];
+	int reference_luma = -1;
+	PackedByteArray motion_map;
+	int motion_columns = 0;
+	int motion_rows = 0;
+	std::vector<uint32_t> block_sums;
+	// Level i is downscaled by 2^(i + 1), buffers and images are reused every frame.
+	int pyramid_levels = 0;
+	PackedByteArray pyramid_data[PYRAMID_MAX_LEVELS];
+	Ref<Image> pyramid_images[PYRAMID_MAX_LEVELS];
+
+	void reset_statistics();
+	// Compares the luma of p_frame against the last converted frame in MOTION_BLOCK_SIZE blocks,
+	// returns false if no block changed enough to convert the frame.
+	bool detect_motion(const frame_kernels::FrameDescriptor &p_frame);
+	// Adds the luma of a converted row to the statistics.
+	void accumulate_row(const uint8_t *p_src, int p_y);
+	// Averages rows p_y - 1 and p_y of level p_level - 1 (p_src) into level p_level once p_y completes a pair,
+	// then continues with the next level, so the pyramid is built while the image is converted.
+	void downsample_row(int p_level, const uint8_t *p_src, int p_channels, int p_y);
+	void update_pyramid_images();
+	TypedArray<Image> build_pyramid() const override;
+	Dictionary build_statistics() const override;
 
 public:
 	AbstractYuyvBufferDecoder(CameraFeed *p_camera_feed, int p_width, int p_height, int *p_component_indexes);
 	~AbstractYuyvBufferDecoder();
+
+	// Collects a luma histogram, mean, min, max and tile averages while converting.
+	void set_statistics_enabled(bool p_enabled);
+	// Mean absolute luma difference of a block that counts as motion, frames without any are skipped.
+	void set_motion_threshold(int p_threshold);
+	// Number of half, quarter and eighth scale levels produced with each frame.
+	void set_pyramid_levels(int p_levels);
 };
 
 class YuyvToGrayscaleBufferDecoder : public AbstractYuyvBufferDecoder {
@@ -72,6 +215,8 @@ private:
 	PackedByteArray image_data;
 
 public:
+	static constexpr float COST_PER_PIXEL = 0.4f;
+
 	YuyvToGrayscaleBufferDecoder(CameraFeed *p_camera_feed, int p_width, int p_height, int *p_component_indexes);
 	virtual void decode(StreamingBuffer p_buffer, int p_rotation = 0) override;
 };
@@ -81,6 +226,8 @@ private:
 	PackedByteArray image_data;
 
 public:
+	static constexpr float COST_PER_PIXEL = 1.0f;
+
 	YuyvToRgbBufferDecoder(CameraFeed *p_camera_feed, int p_width, int p_height, int *p_component_indexes);
 	virtual void decode(StreamingBuffer p_buffer, int p_rotation = 0) override;
 };
@@ -91,17 +238,168 @@ private:
 	bool rgba = false;
 
 public:
+	static constexpr float COST_PER_PIXEL = 0.1f;
+
 	CopyBufferDecoder(CameraFeed *p_camera_feed, int p_width, int p_height, bool p_rgba);
 	virtual void decode(StreamingBuffer p_buffer, int p_rotation = 0) override;
 };
 
+// Packed 8-bit RGB and grayscale formats. Layouts matching an Image format are copied row by row,
+// the others are converted with a single channel permutation.
+class PackedBufferDecoder : public BufferDecoder {
+public:
+	enum Layout {
+		LAYOUT_GRAY8 = frame_kernels::PACKED_GRAY8,
+		LAYOUT_RGB = frame_kernels::PACKED_RGB,
+		LAYOUT_BGR = frame_kernels::PACKED_BGR,
+		LAYOUT_RGBX = frame_kernels::PACKED_RGBX,
+		LAYOUT_BGRX = frame_kernels::PACKED_BGRX,
+	};
+
+private:
+	PackedByteArray image_data;
+	Layout layout = LAYOUT_RGB;
+
+public:
+	static constexpr float COST_PER_PIXEL = 0.1f;
+	static constexpr float SWIZZLE_COST_PER_PIXEL = 0.15f;
+
+	PackedBufferDecoder(CameraFeed *p_camera_feed, int p_width, int p_height, Layout p_layout);
+	virtual void decode(StreamingBuffer p_buffer, int p_rotation = 0) override;
+};
+
+// Passes 16-bit little endian luminance (depth, IR) through without an 8-bit round trip. Half and
+// float outputs are normalized to the range, 8-bit output maps the range to 0-255 for display.
+class Gray16BufferDecoder : public BufferDecoder {
+public:
+	enum Mode {
+		MODE_PACKED, // Both bytes as FORMAT_RG8, low byte in red.
+		MODE_HALF,
+		MODE_FLOAT,
+		MODE_L8,
+	};
+
+private:
+	PackedByteArray image_data;
+	Mode mode = MODE_PACKED;
+	float range_min = 0.0f;
+	float range_scale = 1.0f;
+	// Every 16-bit value converted once, half and 8-bit outputs are a lookup per pixel.
+	std::vector<uint16_t> half_table;
+	std::vector<uint8_t> l8_table;
+
+public:
+	static constexpr float COST_PER_PIXEL = 0.2f;
+
+	Gray16BufferDecoder(CameraFeed *p_camera_feed, int p_width, int p_height, Mode p_mode, int p_range_min = 0, int p_range_max = 65535);
+	virtual void decode(StreamingBuffer p_buffer, int p_rotation = 0) override;
+};
+
+// Demosaics 8-bit Bayer frames into RGB8. The pattern is given by the position of the red sample in
+// each 2x2 cell. Binning outputs one pixel per cell at half resolution instead of interpolating.
+class BayerBufferDecoder : public BufferDecoder {
+private:
+	PackedByteArray image_data;
+	int red_x = 0;
+	int red_y = 0;
+	bool binning = false;
+
+public:
+	static constexpr float COST_PER_PIXEL = 1.2f;
+	static constexpr float BINNING_COST_PER_PIXEL = 0.2f;
+
+	BayerBufferDecoder(CameraFeed *p_camera_feed, int p_width, int p_height, int p_red_x, int p_red_y, bool p_binning);
+	virtual void decode(StreamingBuffer p_buffer, int p_rotation = 0) override;
+};
+
+// With several threads, frames are decoded concurrently and delivered in capture order. At most
+// one more frame than there are threads is in flight, the oldest frame not yet being decoded is
+// dropped when a new one arrives on a full pipeline.
 class JpegBufferDecoder : public BufferDecoder {
 private:
+	struct Job {
+		PackedByteArray data;
+		PackedByteArray pixels;
+		Ref<Image> image;
+		int rotation = 0;
+		bool decoded = false;
+		bool valid = false;
+	};
+
 	PackedByteArray image_data;
+	PackedByteArray pixels;
+	int target_width = 0;
+	int target_height = 0;
+	std::vector<std::thread> workers;
+	std::mutex jobs_mutex;
+	std::condition_variable jobs_condition;
+	std::vector<Job> jobs;
+	std::vector<Job *> free_jobs;
+	// Jobs waiting for a worker, and all jobs in flight in capture order.
+	std::deque<Job *> queued_jobs;
+	std::deque<Job *> pipeline;
+	bool exiting = false;
+
+	void worker_main();
+	void deliver_decoded();
+	bool decode_jpeg(const PackedByteArray &p_data, PackedByteArray &r_pixels, const Ref<Image> &p_image) const;
+
+protected:
+	void decode_blocking(StreamingBuffer p_buffer, int p_rotation) override;
 
 public:
-	JpegBufferDecoder(CameraFeed *p_camera_feed);
+	static constexpr float COST_PER_PIXEL = 4.0f;
+
+#ifdef LIBJPEG_ENABLED
+	static constexpr bool SCALED_DECODING = true;
+#else
+	static constexpr bool SCALED_DECODING = false;
+#endif
+
+	// Largest power of two up to 8 that keeps the image at least the target size, 0 ignores a dimension.
+	static int get_scale_denominator(int p_width, int p_height, int p_target_width, int p_target_height);
+
+	JpegBufferDecoder(CameraFeed *p_camera_feed, int p_threads = 1);
+	~JpegBufferDecoder();
+
+	// Frames are scaled down by 1/2, 1/4 or 1/8 while they still cover this size, in the DCT domain
+	// with libjpeg, otherwise after decoding.
+	void set_target_size(int p_width, int p_height);
+	virtual void decode(StreamingBuffer p_buffer, int p_rotation = 0) override;
+};
+
+#ifdef FFMPEG_ENABLED
+struct AVCodecContext;
+struct AVFrame;
+struct AVPacket;
+struct SwsContext;
+
+// Decodes an H.264 byte stream with libavcodec. Frame threading adds a frame of delay per thread,
+// so low latency decoding uses slice threads and disables reordering delay instead.
+class H264BufferDecoder : public BufferDecoder {
+private:
+	AVCodecContext *context = nullptr;
+	AVFrame *frame = nullptr;
+	AVPacket *packet = nullptr;
+	SwsContext *scaler = nullptr;
+	// Compressed input with the padding libavcodec requires, and the RGB output.
+	PackedByteArray packet_data;
+	PackedByteArray image_data;
+
+	bool send_packet(StreamingBuffer p_buffer);
+
+protected:
+	void skip(StreamingBuffer p_buffer) override;
+
+public:
+	static constexpr float COST_PER_PIXEL = 3.0f;
+
+	H264BufferDecoder(CameraFeed *p_camera_feed, int p_threads, bool p_low_latency);
+	~H264BufferDecoder();
+	bool is_valid() const;
+	bool requires_every_frame() const override;
 	virtual void decode(StreamingBuffer p_buffer, int p_rotation = 0) override;
 };
+#endif
 
 #endif // BUFFER_DECODER_H
@@ -1,8 +1,16 @@
 #include "camera_feed.h"
 
+#include <thread>
+
+#include "godot_cpp/classes/engine.hpp"
+#include "godot_cpp/variant/typed_array.hpp"
 #include "godot_cpp/core/class_db.hpp"
 
 namespace extension {
+std::atomic<uint64_t> CameraFeed::process_frame = 0;
+
+void CameraFeed::update_process_frame() { process_frame = Engine::get_singleton()->get_process_frames(); }
+
 CameraFeed::CameraFeed() :
 		this_(nullptr) {}
 
@@ -15,17 +23,114 @@ void CameraFeed::set_this(CameraFeedExtension *feed) { this_ = feed; }
 
 bool CameraFeed::set_format(int p_index, const Dictionary &p_parameters) { return false; }
 
-TypedArray<Dictionary> CameraFeed::get_formats() const { return TypedArray<Dictionary>(); }
+TypedArray<Dictionary> CameraFeed::get_formats() { return TypedArray<Dictionary>(); }
+
+int CameraFeed::select_format(const Dictionary &p_constraints) { return -1; }
+
+Dictionary CameraFeed::get_summary() const { return Dictionary(); }
+
+Dictionary CameraFeed::get_statistics() const { return Dictionary(); }
+
+Dictionary CameraFeed::get_frame_statistics() const { return Dictionary(); }
+
+TypedArray<Image> CameraFeed::get_frame_pyramid() const { return TypedArray<Image>(); }
 
 bool CameraFeed::activate_feed() { return true; }
 
 void CameraFeed::deactivate_feed() {}
+
+bool CameraFeed::set_paused(bool p_paused) { return false; }
+
+bool CameraFeed::is_paused() const { return paused; }
+
+bool CameraFeed::requires_every_frame() const { return false; }
+
+void CameraFeed::emit_activated(const Dictionary &p_format) {
+	this_->call_deferred("emit_signal", "activated", p_format);
+}
+
+void CameraFeed::emit_activation_failed(const String &p_error) {
+	this_->call_deferred("emit_signal", "activation_failed", p_error);
+	// Leave the feed inactive so it can be activated again.
+	this_->call_deferred("set_active", false);
+}
+
+bool CameraFeed::is_activation_async() const { return false; }
+
+bool CameraFeed::has_consumers() const {
+	// There is no way to tell whether a CameraTexture is drawn, so a displayed feed always has consumers.
+	if (displayed) {
+		return true;
+	}
+	// A frame requested in the previous engine frame keeps the feed decoding until the next request is due.
+	return consumed_frame.load() + 1 >= process_frame.load();
+}
+
+bool CameraFeed::decode_pending() { return false; }
+
+bool CameraFeed::dispatch_frame(BufferDecoder *p_decoder, StreamingBuffer p_buffer, int p_rotation, uint64_t p_timestamp_usec, bool p_defer) {
+	listener_users++;
+	FrameListener *listener = frame_listener;
+	if (listener) {
+		listener->on_frame(this, p_buffer, p_timestamp_usec);
+	}
+	listener_users--;
+	if (listener) {
+		return false;
+	}
+	if (p_decoder) {
+		return p_decoder->submit(p_buffer, p_rotation, p_defer || (lazy_decoding && !has_consumers()));
+	}
+	return false;
+}
+
+void CameraFeed::set_frame_listener(FrameListener *p_listener) {
+	frame_listener = p_listener;
+	// Both sides are sequentially consistent, a dispatch either sees the new listener or is waited for.
+	while (listener_users.load() != 0) {
+		std::this_thread::yield();
+	}
+}
+
+Ref<Image> CameraFeed::decode_frame(StreamingBuffer p_buffer) { return Ref<Image>(); }
+
+void CameraFeed::set_lazy_decoding(bool p_enabled) { lazy_decoding = p_enabled; }
+
+bool CameraFeed::is_lazy_decoding() const { return lazy_decoding; }
+
+void CameraFeed::set_displayed(bool p_displayed) { displayed = p_displayed; }
+
+bool CameraFeed::is_displayed() const { return displayed; }
+
+bool CameraFeed::request_frame() {
+	update_process_frame();
+	consumed_frame = process_frame.load();
+	return decode_pending();
+}
 } // namespace extension
 
 void CameraFeedExtension::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("set_format", "index", "parameters"), &CameraFeedExtension::set_format);
 	ClassDB::bind_method(D_METHOD("get_formats"), &CameraFeedExtension::get_formats);
+	ClassDB::bind_method(D_METHOD("select_format", "constraints"), &CameraFeedExtension::select_format);
+	ClassDB::bind_method(D_METHOD("get_summary"), &CameraFeedExtension::get_summary);
+	ClassDB::bind_method(D_METHOD("get_statistics"), &CameraFeedExtension::get_statistics);
+	ClassDB::bind_method(D_METHOD("get_frame_statistics"), &CameraFeedExtension::get_frame_statistics);
+	ClassDB::bind_method(D_METHOD("get_frame_pyramid"), &CameraFeedExtension::get_frame_pyramid);
+	ClassDB::bind_method(D_METHOD("set_paused", "paused"), &CameraFeedExtension::set_paused);
+	ClassDB::bind_method(D_METHOD("is_paused"), &CameraFeedExtension::is_paused);
+	ClassDB::bind_method(D_METHOD("set_lazy_decoding", "enabled"), &CameraFeedExtension::set_lazy_decoding);
+	ClassDB::bind_method(D_METHOD("is_lazy_decoding"), &CameraFeedExtension::is_lazy_decoding);
+	ClassDB::bind_method(D_METHOD("set_displayed", "displayed"), &CameraFeedExtension::set_displayed);
+	ClassDB::bind_method(D_METHOD("is_displayed"), &CameraFeedExtension::is_displayed);
+	ClassDB::bind_method(D_METHOD("request_frame"), &CameraFeedExtension::request_frame);
 	ADD_PROPERTY(PropertyInfo(Variant::ARRAY, "formats"), "", "get_formats");
+	ADD_SIGNAL(MethodInfo("activated", PropertyInfo(Variant::DICTIONARY, "format")));
+	ADD_SIGNAL(MethodInfo("activation_failed", PropertyInfo(Variant::STRING, "error")));
+	ADD_SIGNAL(MethodInfo("motion_detected", PropertyInfo(Variant::PACKED_BYTE_ARRAY, "motion_map"), PropertyInfo(Variant::INT, "changed_blocks")));
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "paused"), "set_paused", "is_paused");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "lazy_decoding"), "set_lazy_decoding", "is_lazy_decoding");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "displayed"), "set_displayed", "is_displayed");
 }
 
 CameraFeedExtension::CameraFeedExtension(std::unique_ptr<extension::CameraFeed> impl) {
@@ -39,8 +144,44 @@ bool CameraFeedExtension::set_format(int p_index, const Dictionary &p_parameters
 
 TypedArray<Dictionary> CameraFeedExtension::get_formats() const { return impl->get_formats(); }
 
-bool CameraFeedExtension::_activate_feed() { return impl->activate_feed(); }
+int CameraFeedExtension::select_format(const Dictionary &p_constraints) { return impl->select_format(p_constraints); }
+
+Dictionary CameraFeedExtension::get_summary() const { return impl->get_summary(); }
+
+Dictionary CameraFeedExtension::get_statistics() const { return impl->get_statistics(); }
+
+Dictionary CameraFeedExtension::get_frame_statistics() const { return impl->get_frame_statistics(); }
+
+TypedArray<Image> CameraFeedExtension::get_frame_pyramid() const { return impl->get_frame_pyramid(); }
+
+bool CameraFeedExtension::_activate_feed() {
+	bool result = impl->activate_feed();
+	if (!impl->is_activation_async()) {
+		if (result) {
+			TypedArray<Dictionary> formats = impl->get_formats();
+			int index = impl->selected_format;
+			impl->emit_activated(index >= 0 && index < formats.size() ? Dictionary(formats[index]) : Dictionary());
+		} else {
+			call_deferred("emit_signal", "activation_failed", "Feed failed to activate.");
+		}
+	}
+	return result;
+}
 
 void CameraFeedExtension::_deactivate_feed() { impl->deactivate_feed(); }
 
+bool CameraFeedExtension::set_paused(bool p_paused) { return impl->set_paused(p_paused); }
+
+bool CameraFeedExtension::is_paused() const { return impl->is_paused(); }
+
+void CameraFeedExtension::set_lazy_decoding(bool p_enabled) { impl->set_lazy_decoding(p_enabled); }
+
+bool CameraFeedExtension::is_lazy_decoding() const { return impl->is_lazy_decoding(); }
+
+void CameraFeedExtension::set_displayed(bool p_displayed) { impl->set_displayed(p_displayed); }
+
+bool CameraFeedExtension::is_displayed() const { return impl->is_displayed(); }
+
+bool CameraFeedExtension::request_frame() { return impl->request_frame(); }
+
 extension::CameraFeed *CameraFeedExtension::get_impl() { return impl.get(); }
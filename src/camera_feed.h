@@ -1,32 +1,91 @@
 #ifndef CAMERA_FEED_H
 #define CAMERA_FEED_H
 
+#include <atomic>
 #include <memory>
 
 #include "godot_cpp/classes/camera_feed.hpp"
 
+#include "buffer_decoder.h"
+
 using namespace godot;
 
 class CameraFeedExtension;
 
 namespace extension {
+class CameraFeed;
+
+// Receives raw frames instead of the feed's decoder, e.g. to synchronize several feeds.
+class FrameListener {
+public:
+	virtual void on_frame(CameraFeed *p_feed, StreamingBuffer p_buffer, uint64_t p_timestamp_usec) = 0;
+	virtual ~FrameListener() {}
+};
+
 class CameraFeed {
 protected:
 	CameraFeedExtension *this_;
 	int selected_format = -1;
+	// Flags below are set on the main thread and read by capture threads.
+	std::atomic<bool> lazy_decoding = false;
+	// Shown through a CameraTexture, which counts as a consumer on every frame.
+	std::atomic<bool> displayed = true;
+	std::atomic<bool> paused = false;
+	std::atomic<uint64_t> consumed_frame = 0;
+	// The engine's process frame, capture threads must not ask the Engine for it.
+	static std::atomic<uint64_t> process_frame;
+	std::atomic<FrameListener *> frame_listener = nullptr;
+	// Capture threads inside dispatch_frame(), set_frame_listener() waits for them to leave.
+	std::atomic<int> listener_users = 0;
 
 	virtual void set_this(CameraFeedExtension *feed);
 
+	// Deferred to the main thread, backends may call these from any thread.
+	void emit_activated(const Dictionary &p_format);
+	void emit_activation_failed(const String &p_error);
+	// Asynchronous backends emit the activation signals themselves once the stream is running.
+	virtual bool is_activation_async() const;
+
+	bool has_consumers() const;
+	virtual bool decode_pending();
+	// Hands a captured buffer to the frame listener, or to the decoder when there is none. Returns
+	// true if the frame was decoded right away, p_defer always leaves it for decode_pending().
+	bool dispatch_frame(BufferDecoder *p_decoder, StreamingBuffer p_buffer, int p_rotation, uint64_t p_timestamp_usec, bool p_defer = false);
+
 public:
+	// Publishes the current process frame, main thread only.
+	static void update_process_frame();
+
 	CameraFeed();
 	CameraFeed(CameraFeedExtension *feed);
 	virtual ~CameraFeed();
 
 	virtual bool set_format(int p_index, const Dictionary &p_parameters);
-	virtual TypedArray<Dictionary> get_formats() const;
+	virtual TypedArray<Dictionary> get_formats();
+	virtual int select_format(const Dictionary &p_constraints);
+	virtual Dictionary get_summary() const;
+	virtual Dictionary get_statistics() const;
+	virtual Dictionary get_frame_statistics() const;
+	virtual TypedArray<Image> get_frame_pyramid() const;
 
 	virtual bool activate_feed();
 	virtual void deactivate_feed();
+	// Stops frame delivery while keeping the negotiated stream, returns false if the backend cannot pause.
+	virtual bool set_paused(bool p_paused);
+	bool is_paused() const;
+	// Whether the selected format is inter-coded, so frames must not be dropped, e.g. by a group.
+	virtual bool requires_every_frame() const;
+
+	void set_lazy_decoding(bool p_enabled);
+	bool is_lazy_decoding() const;
+	void set_displayed(bool p_displayed);
+	bool is_displayed() const;
+	bool request_frame();
+
+	// Returns once no capture thread can still be calling the previous listener.
+	void set_frame_listener(FrameListener *p_listener);
+	// Decodes a buffer previously handed to the frame listener, returns the decoded image.
+	virtual Ref<Image> decode_frame(StreamingBuffer p_buffer);
 
 	friend class ::CameraFeedExtension;
 };
@@ -48,9 +107,22 @@ public:
 
 	bool set_format(int p_index, const Dictionary &p_parameters);
 	TypedArray<Dictionary> get_formats() const;
+	int select_format(const Dictionary &p_constraints);
+	Dictionary get_summary() const;
+	Dictionary get_statistics() const;
+	Dictionary get_frame_statistics() const;
+	TypedArray<Image> get_frame_pyramid() const;
 
 	bool _activate_feed() override;
 	void _deactivate_feed() override;
+	bool set_paused(bool p_paused);
+	bool is_paused() const;
+
+	void set_lazy_decoding(bool p_enabled);
+	bool is_lazy_decoding() const;
+	void set_displayed(bool p_displayed);
+	bool is_displayed() const;
+	bool request_frame();
 
 	extension::CameraFeed *get_impl();
 };
@@ -0,0 +1,296 @@
+#include "camera_feed_group.h"
+
+#include "godot_cpp/classes/worker_thread_pool.hpp"
+#include "godot_cpp/core/class_db.hpp"
+#include "godot_cpp/variant/callable_method_pointer.hpp"
+
+void CameraFeedGroup::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("add_feed", "feed"), &CameraFeedGroup::add_feed);
+	ClassDB::bind_method(D_METHOD("remove_feed", "feed"), &CameraFeedGroup::remove_feed);
+	ClassDB::bind_method(D_METHOD("get_feeds"), &CameraFeedGroup::get_feeds);
+	ClassDB::bind_method(D_METHOD("set_tolerance_usec", "tolerance"), &CameraFeedGroup::set_tolerance_usec);
+	ClassDB::bind_method(D_METHOD("get_tolerance_usec"), &CameraFeedGroup::get_tolerance_usec);
+	ClassDB::bind_method(D_METHOD("set_max_buffered_frames", "frames"), &CameraFeedGroup::set_max_buffered_frames);
+	ClassDB::bind_method(D_METHOD("get_max_buffered_frames"), &CameraFeedGroup::get_max_buffered_frames);
+	ClassDB::bind_method(D_METHOD("activate"), &CameraFeedGroup::activate);
+	ClassDB::bind_method(D_METHOD("deactivate"), &CameraFeedGroup::deactivate);
+	ClassDB::bind_method(D_METHOD("is_active"), &CameraFeedGroup::is_active);
+	ClassDB::bind_method(D_METHOD("get_skew_statistics"), &CameraFeedGroup::get_skew_statistics);
+	ClassDB::bind_method(D_METHOD("_process_frameset"), &CameraFeedGroup::_process_frameset);
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "tolerance_usec"), "set_tolerance_usec", "get_tolerance_usec");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "max_buffered_frames"), "set_max_buffered_frames", "get_max_buffered_frames");
+	ADD_SIGNAL(MethodInfo("activation_failed", PropertyInfo(Variant::STRING, "error")));
+	ADD_SIGNAL(MethodInfo("frameset_ready", PropertyInfo(Variant::ARRAY, "images"), PropertyInfo(Variant::PACKED_INT64_ARRAY, "timestamps"), PropertyInfo(Variant::INT, "skew_usec")));
+}
+
+CameraFeedGroup::CameraFeedGroup() {}
+
+CameraFeedGroup::~CameraFeedGroup() {
+	deactivate();
+}
+
+bool CameraFeedGroup::add_feed(const Ref<CameraFeedExtension> &p_feed) {
+	ERR_FAIL_COND_V(p_feed.is_null(), false);
+	ERR_FAIL_COND_V_MSG(active, false, "Feed group is active.");
+	for (const Member &member : members) {
+		if (member.feed == p_feed) {
+			return false;
+		}
+	}
+	Member member;
+	member.feed = p_feed;
+	members.push_back(member);
+	return true;
+}
+
+bool CameraFeedGroup::remove_feed(const Ref<CameraFeedExtension> &p_feed) {
+	ERR_FAIL_COND_V_MSG(active, false, "Feed group is active.");
+	for (int i = 0; i < members.size(); i++) {
+		if (members[i].feed == p_feed) {
+			members.remove_at(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+TypedArray<CameraFeedExtension> CameraFeedGroup::get_feeds() const {
+	TypedArray<CameraFeedExtension> feeds;
+	for (const Member &member : members) {
+		feeds.push_back(member.feed);
+	}
+	return feeds;
+}
+
+void CameraFeedGroup::set_tolerance_usec(int64_t p_tolerance) {
+	ERR_FAIL_COND(p_tolerance < 0);
+	std::lock_guard<std::mutex> lock(mutex);
+	tolerance_usec = p_tolerance;
+}
+
+int64_t CameraFeedGroup::get_tolerance_usec() const { return tolerance_usec; }
+
+void CameraFeedGroup::set_max_buffered_frames(int p_frames) {
+	ERR_FAIL_COND(p_frames < 1);
+	std::lock_guard<std::mutex> lock(mutex);
+	max_buffered_frames = p_frames;
+}
+
+int CameraFeedGroup::get_max_buffered_frames() const { return max_buffered_frames; }
+
+bool CameraFeedGroup::activate() {
+	ERR_FAIL_COND_V_MSG(members.size() < 2, false, "Feed group needs at least two feeds.");
+	if (active) {
+		return true;
+	}
+	for (const Member &member : members) {
+		// Frames that cannot be matched are dropped, which inter-coded streams do not survive.
+		ERR_FAIL_COND_V_MSG(member.feed->get_impl()->requires_every_frame(), false, "Feeds with inter-coded formats (H.264) cannot be grouped.");
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		active = true;
+		framesets = 0;
+		dropped_frames = 0;
+		failed_decodes = 0;
+		total_skew_usec = 0;
+		max_skew_usec = 0;
+		last_skew_usec = 0;
+	}
+	for (const Member &member : members) {
+		member.feed->get_impl()->set_frame_listener(this);
+		// Asynchronous backends only report a failure once the stream was set up.
+		member.feed->connect("activation_failed", callable_mp(this, &CameraFeedGroup::_on_activation_failed));
+	}
+	for (const Member &member : members) {
+		member.feed->set_active(true);
+		if (!member.feed->is_active()) {
+			deactivate();
+			return false;
+		}
+	}
+	return true;
+}
+
+void CameraFeedGroup::deactivate() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!active) {
+			return;
+		}
+		active = false;
+		frameset_pending = false;
+	}
+	for (int i = 0; i < members.size(); i++) {
+		Member &member = members.write[i];
+		member.feed->get_impl()->set_frame_listener(nullptr);
+		Callable on_activation_failed = callable_mp(this, &CameraFeedGroup::_on_activation_failed);
+		if (member.feed->is_connected("activation_failed", on_activation_failed)) {
+			member.feed->disconnect("activation_failed", on_activation_failed);
+		}
+		member.feed->set_active(false);
+		member.frames.clear();
+		member.matched = Frame();
+	}
+	decoding.clear();
+	spare_buffers.clear();
+}
+
+bool CameraFeedGroup::is_active() const { return active; }
+
+void CameraFeedGroup::_on_activation_failed(const String &p_error) {
+	// The other feeds are stopped too, a frameset can never be complete.
+	deactivate();
+	emit_signal("activation_failed", p_error);
+}
+
+Dictionary CameraFeedGroup::get_skew_statistics() {
+	std::lock_guard<std::mutex> lock(mutex);
+	Dictionary statistics;
+	statistics["framesets"] = framesets;
+	statistics["dropped_frames"] = dropped_frames;
+	statistics["failed_decodes"] = failed_decodes;
+	statistics["mean_skew_usec"] = framesets ? total_skew_usec / framesets : 0;
+	statistics["max_skew_usec"] = max_skew_usec;
+	statistics["last_skew_usec"] = last_skew_usec;
+	return statistics;
+}
+
+void CameraFeedGroup::on_frame(extension::CameraFeed *p_feed, StreamingBuffer p_buffer, uint64_t p_timestamp_usec) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!active) {
+		return;
+	}
+	for (int i = 0; i < members.size(); i++) {
+		Member &member = members.write[i];
+		if (member.feed->get_impl() != p_feed) {
+			continue;
+		}
+		if (int(member.frames.size()) >= max_buffered_frames) {
+			drop_frame(member);
+		}
+		Frame frame;
+		if (!spare_buffers.is_empty()) {
+			frame.data = spare_buffers[spare_buffers.size() - 1];
+			spare_buffers.remove_at(spare_buffers.size() - 1);
+		}
+		frame.data.resize(p_buffer.length);
+		memcpy(frame.data.ptrw(), p_buffer.start, p_buffer.length);
+		frame.stride = p_buffer.stride;
+		frame.timestamp = p_timestamp_usec;
+		member.frames.push_back(frame);
+		match_frames();
+		return;
+	}
+}
+
+void CameraFeedGroup::drop_frame(Member &p_member) {
+	spare_buffers.push_back(p_member.frames.front().data);
+	p_member.frames.pop_front();
+	dropped_frames++;
+}
+
+void CameraFeedGroup::match_frames() {
+	while (true) {
+		int oldest = -1;
+		uint64_t min_timestamp = UINT64_MAX;
+		uint64_t max_timestamp = 0;
+		for (int i = 0; i < members.size(); i++) {
+			const Member &member = members[i];
+			if (member.frames.empty()) {
+				return;
+			}
+			uint64_t timestamp = member.frames.front().timestamp;
+			if (timestamp < min_timestamp) {
+				min_timestamp = timestamp;
+				oldest = i;
+			}
+			max_timestamp = MAX(max_timestamp, timestamp);
+		}
+		uint64_t skew = max_timestamp - min_timestamp;
+		if (skew > tolerance_usec) {
+			// Every other feed is already past the oldest frame, it can never be matched.
+			drop_frame(members.write[oldest]);
+			continue;
+		}
+		for (int i = 0; i < members.size(); i++) {
+			Member &member = members.write[i];
+			if (frameset_pending) {
+				// The previous frameset was not decoded yet and is superseded.
+				spare_buffers.push_back(member.matched.data);
+				dropped_frames++;
+			}
+			member.matched = member.frames.front();
+			member.frames.pop_front();
+		}
+		framesets++;
+		total_skew_usec += skew;
+		max_skew_usec = MAX(max_skew_usec, skew);
+		last_skew_usec = skew;
+		frameset_pending = true;
+		if (!frameset_scheduled) {
+			frameset_scheduled = true;
+			call_deferred("_process_frameset");
+		}
+	}
+}
+
+void CameraFeedGroup::_process_frameset() {
+	PackedInt64Array timestamps;
+	Array images;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		frameset_scheduled = false;
+		if (!active || !frameset_pending) {
+			return;
+		}
+		frameset_pending = false;
+		decoding.resize(members.size());
+		for (int i = 0; i < members.size(); i++) {
+			Member &member = members.write[i];
+			decoding[i].feed = member.feed->get_impl();
+			decoding[i].frame = member.matched;
+			member.matched = Frame();
+			timestamps.push_back(decoding[i].frame.timestamp);
+		}
+	}
+	// Frames of different feeds go through different decoders, so they can be converted in parallel.
+	WorkerThreadPool *pool = WorkerThreadPool::get_singleton();
+	int64_t task = pool->add_group_task(callable_mp(this, &CameraFeedGroup::_decode_member), decoding.size(), -1, true, "CameraFeedGroup");
+	pool->wait_for_group_task_completion(task);
+	uint64_t min_timestamp = UINT64_MAX;
+	uint64_t max_timestamp = 0;
+	bool complete = true;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (Decode &decode : decoding) {
+			complete = complete && decode.image.is_valid();
+			images.push_back(decode.image);
+			min_timestamp = MIN(min_timestamp, decode.frame.timestamp);
+			max_timestamp = MAX(max_timestamp, decode.frame.timestamp);
+			spare_buffers.push_back(decode.frame.data);
+			decode.frame = Frame();
+			decode.image.unref();
+		}
+		if (!complete) {
+			failed_decodes++;
+		}
+	}
+	if (!complete) {
+		return;
+	}
+	emit_signal("frameset_ready", images, timestamps, int64_t(max_timestamp - min_timestamp));
+}
+
+void CameraFeedGroup::_decode_member(uint32_t p_index) {
+	Decode &decode = decoding[p_index];
+	StreamingBuffer buffer;
+	buffer.start = decode.frame.data.ptrw();
+	buffer.length = decode.frame.data.size();
+	buffer.stride = decode.frame.stride;
+	// The decoder reuses its image for the next frame, the frameset keeps its own copy.
+	Ref<Image> image = decode.feed->decode_frame(buffer);
+	if (image.is_valid()) {
+		decode.image = image->duplicate();
+	}
+}
@@ -0,0 +1,87 @@
+#ifndef CAMERA_FEED_GROUP_H
+#define CAMERA_FEED_GROUP_H
+
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "godot_cpp/classes/ref_counted.hpp"
+#include "godot_cpp/variant/typed_array.hpp"
+
+#include "camera_feed.h"
+
+using namespace godot;
+
+class CameraFeedGroup : public RefCounted, public extension::FrameListener {
+	GDCLASS(CameraFeedGroup, RefCounted)
+
+private:
+	struct Frame {
+		PackedByteArray data;
+		int stride = 0;
+		uint64_t timestamp = 0;
+	};
+
+	struct Member {
+		Ref<CameraFeedExtension> feed;
+		std::deque<Frame> frames;
+		Frame matched;
+	};
+
+	struct Decode {
+		extension::CameraFeed *feed = nullptr;
+		Frame frame;
+		Ref<Image> image;
+	};
+
+	std::mutex mutex;
+	Vector<Member> members;
+	bool active = false;
+	bool frameset_pending = false;
+	bool frameset_scheduled = false;
+	uint64_t tolerance_usec = 5000;
+	int max_buffered_frames = 4;
+	Vector<PackedByteArray> spare_buffers;
+	// Only touched on the main thread and by the decode tasks it waits for.
+	std::vector<Decode> decoding;
+
+	uint64_t framesets = 0;
+	uint64_t dropped_frames = 0;
+	// Matched framesets dropped because a member did not decode to an image.
+	uint64_t failed_decodes = 0;
+	uint64_t total_skew_usec = 0;
+	uint64_t max_skew_usec = 0;
+	uint64_t last_skew_usec = 0;
+
+	void match_frames();
+	void drop_frame(Member &p_member);
+	void _process_frameset();
+	void _decode_member(uint32_t p_index);
+	void _on_activation_failed(const String &p_error);
+
+protected:
+	static void _bind_methods();
+
+public:
+	CameraFeedGroup();
+	~CameraFeedGroup();
+
+	bool add_feed(const Ref<CameraFeedExtension> &p_feed);
+	bool remove_feed(const Ref<CameraFeedExtension> &p_feed);
+	TypedArray<CameraFeedExtension> get_feeds() const;
+
+	void set_tolerance_usec(int64_t p_tolerance);
+	int64_t get_tolerance_usec() const;
+	void set_max_buffered_frames(int p_frames);
+	int get_max_buffered_frames() const;
+
+	bool activate();
+	void deactivate();
+	bool is_active() const;
+
+	Dictionary get_skew_statistics();
+
+	void on_frame(extension::CameraFeed *p_feed, StreamingBuffer p_buffer, uint64_t p_timestamp_usec) override;
+};
+
+#endif
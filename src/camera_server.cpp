@@ -1,6 +1,7 @@
 #include "camera_server.h"
 
 #include "godot_cpp/classes/engine.hpp"
+#include "godot_cpp/classes/scene_tree.hpp"
 #include "godot_cpp/core/class_db.hpp"
 
 #include "camera_feed.h"
@@ -14,6 +15,20 @@ CameraServer::~CameraServer() = default;
 bool CameraServer::request_permission() { return true; }
 
 bool CameraServer::permission_granted() { return true; }
+
+bool CameraServer::is_feeds_ready() { return true; }
+
+Dictionary CameraServer::get_startup_timings() { return Dictionary(); }
+
+Ref<CameraFeedExtension> CameraServer::get_feed_by_node_name(const String &p_node_name) { return Ref<CameraFeedExtension>(); }
+
+void CameraServer::process_events() {}
+
+void CameraServer::emit_feeds_ready() {
+	if (!feeds_ready_emitted.exchange(true)) {
+		this_->call_deferred("emit_signal", "feeds_ready");
+	}
+}
 } // namespace extension
 
 CameraServerExtension *CameraServerExtension::singleton = nullptr;
@@ -21,7 +36,12 @@ CameraServerExtension *CameraServerExtension::singleton = nullptr;
 void CameraServerExtension::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("request_permission"), &CameraServerExtension::request_permission);
 	ClassDB::bind_method(D_METHOD("permission_granted"), &CameraServerExtension::permission_granted);
+	ClassDB::bind_method(D_METHOD("is_feeds_ready"), &CameraServerExtension::is_feeds_ready);
+	ClassDB::bind_method(D_METHOD("get_startup_timings"), &CameraServerExtension::get_startup_timings);
+	ClassDB::bind_method(D_METHOD("get_feed_by_node_name", "node_name"), &CameraServerExtension::get_feed_by_node_name);
+	ClassDB::bind_method(D_METHOD("_process_events"), &CameraServerExtension::_process_events);
 	ADD_SIGNAL(MethodInfo("permission_result", PropertyInfo(Variant::BOOL, "granted")));
+	ADD_SIGNAL(MethodInfo("feeds_ready"));
 }
 
 CameraServerExtension::CameraServerExtension() {
@@ -30,11 +50,25 @@ CameraServerExtension::CameraServerExtension() {
 		server = CameraServer::get_singleton();
 		ERR_FAIL_COND(server == nullptr);
 		set_impl();
+		// Backends that add their feeds synchronously are ready right away.
+		if (impl->is_feeds_ready()) {
+			impl->emit_feeds_ready();
+		}
+		// Lazy feeds compare requests against the process frame from capture threads.
+		SceneTree *tree = Object::cast_to<SceneTree>(Engine::get_singleton()->get_main_loop());
+		if (tree) {
+			tree->connect("process_frame", callable_mp(this, &CameraServerExtension::_on_process_frame));
+		}
 	}
 }
 
 CameraServerExtension::~CameraServerExtension() {
 	if (singleton == this) {
+		SceneTree *tree = Object::cast_to<SceneTree>(Engine::get_singleton()->get_main_loop());
+		Callable on_process_frame = callable_mp(this, &CameraServerExtension::_on_process_frame);
+		if (tree && tree->is_connected("process_frame", on_process_frame)) {
+			tree->disconnect("process_frame", on_process_frame);
+		}
 		TypedArray<CameraFeed> feeds = server->feeds();
 		for (int i = feeds.size() - 1; i >= 0; i--) {
 			Ref<CameraFeedExtension> feed = feeds[i];
@@ -53,4 +87,18 @@ bool CameraServerExtension::request_permission() { return singleton->impl->reque
 
 bool CameraServerExtension::permission_granted() { return singleton->impl->permission_granted(); }
 
+bool CameraServerExtension::is_feeds_ready() { return singleton->impl->is_feeds_ready(); }
+
+Dictionary CameraServerExtension::get_startup_timings() { return singleton->impl->get_startup_timings(); }
+
+Ref<CameraFeedExtension> CameraServerExtension::get_feed_by_node_name(const String &p_node_name) { return singleton->impl->get_feed_by_node_name(p_node_name); }
+
+void CameraServerExtension::_on_process_frame() { extension::CameraFeed::update_process_frame(); }
+
+void CameraServerExtension::_process_events() {
+	if (impl) {
+		impl->process_events();
+	}
+}
+
 CameraServer *CameraServerExtension::get_server() const { return singleton->server; }
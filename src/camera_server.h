@@ -1,6 +1,7 @@
 #ifndef CAMERA_SERVER_H
 #define CAMERA_SERVER_H
 
+#include <atomic>
 #include <memory>
 
 #include "godot_cpp/classes/camera_server.hpp"
@@ -9,10 +10,14 @@
 
 using namespace godot;
 
+class CameraFeedExtension;
 class CameraServerExtension;
 
 namespace extension {
 class CameraServer {
+private:
+	std::atomic<bool> feeds_ready_emitted = false;
+
 protected:
 	CameraServerExtension *this_;
 
@@ -22,6 +27,17 @@ public:
 
 	virtual bool request_permission();
 	virtual bool permission_granted();
+
+	virtual bool is_feeds_ready();
+	virtual Dictionary get_startup_timings();
+	// Stable across replugging, unlike the feed id. Null if the backend has no such name.
+	virtual Ref<CameraFeedExtension> get_feed_by_node_name(const String &p_node_name);
+
+	// Emits feeds_ready on the main thread, at most once.
+	void emit_feeds_ready();
+
+	// Applies work queued by backend threads, called deferred on the main thread.
+	virtual void process_events();
 };
 } // namespace extension
 
@@ -35,6 +51,8 @@ private:
 	std::unique_ptr<extension::CameraServer> impl;
 
 	void set_impl();
+	void _process_events();
+	void _on_process_frame();
 
 protected:
 	static void _bind_methods();
@@ -46,6 +64,10 @@ public:
 	bool request_permission();
 	bool permission_granted();
 
+	bool is_feeds_ready();
+	Dictionary get_startup_timings();
+	Ref<CameraFeedExtension> get_feed_by_node_name(const String &p_node_name);
+
 	CameraServer *get_server() const;
 };
 
@@ -0,0 +1,367 @@
+#include "frame_kernels.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace frame_kernels {
+
+static inline uint8_t clamp_byte(int p_value) {
+	return uint8_t(std::min(std::max(p_value, 0), 255));
+}
+
+bool FrameDescriptor::covers(int p_row_size) const {
+	if (data == nullptr || width <= 0 || height <= 0 || stride < p_row_size) {
+		return false;
+	}
+	return length >= size_t(height - 1) * stride + p_row_size;
+}
+
+void yuyv_row_to_rgb(const uint8_t *p_src, const int *p_indexes, int p_width, uint8_t *p_dst) {
+	const uint8_t *y0_src = p_src + p_indexes[0];
+	const uint8_t *y1_src = p_src + p_indexes[1];
+	const uint8_t *u_src = p_src + p_indexes[2];
+	const uint8_t *v_src = p_src + p_indexes[3];
+	for (int x = 0; x < p_width / 2; x++) {
+		int u = u_src[x * 4] - 128;
+		int v = v_src[x * 4] - 128;
+		// Multiplied rather than shifted, u and v are signed. Compilers emit the same shifts.
+		int u1 = (u * 129) >> 6;
+		int rg = (u * 3 + v * 6) >> 3;
+		int v1 = (v * 3) >> 1;
+		int y0 = y0_src[x * 4];
+		int y1 = y1_src[x * 4];
+
+		*p_dst++ = clamp_byte(y0 + v1);
+		*p_dst++ = clamp_byte(y0 - rg);
+		*p_dst++ = clamp_byte(y0 + u1);
+
+		*p_dst++ = clamp_byte(y1 + v1);
+		*p_dst++ = clamp_byte(y1 - rg);
+		*p_dst++ = clamp_byte(y1 + u1);
+	}
+}
+
+void yuyv_row_to_grayscale(const uint8_t *p_src, const int *p_indexes, int p_width, uint8_t *p_dst) {
+	const uint8_t *y0_src = p_src + p_indexes[0];
+	const uint8_t *y1_src = p_src + p_indexes[1];
+	for (int x = 0; x < p_width / 2; x++) {
+		*p_dst++ = y0_src[x * 4];
+		*p_dst++ = y1_src[x * 4];
+	}
+}
+
+void extract_luma_row(const uint8_t *p_src, int p_offset, int p_width, uint8_t *p_dst, const uint8_t *p_reference, uint32_t *r_block_sums) {
+	int x = 0;
+#ifdef __SSE2__
+	const __m128i mask = _mm_set1_epi16(0x00ff);
+	for (; x + MOTION_BLOCK_SIZE <= p_width; x += MOTION_BLOCK_SIZE) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(p_src + x * 2));
+		__m128i b = _mm_loadu_si128((const __m128i *)(p_src + x * 2 + 16));
+		a = p_offset ? _mm_srli_epi16(a, 8) : _mm_and_si128(a, mask);
+		b = p_offset ? _mm_srli_epi16(b, 8) : _mm_and_si128(b, mask);
+		__m128i y16 = _mm_packus_epi16(a, b);
+		_mm_storeu_si128((__m128i *)(p_dst + x), y16);
+		if (p_reference) {
+			__m128i sad = _mm_sad_epu8(y16, _mm_loadu_si128((const __m128i *)(p_reference + x)));
+			r_block_sums[x / MOTION_BLOCK_SIZE] += _mm_cvtsi128_si32(sad) + _mm_extract_epi16(sad, 4);
+		}
+	}
+#endif
+	for (; x < p_width; x++) {
+		p_dst[x] = p_src[x * 2 + p_offset];
+		if (p_reference) {
+			r_block_sums[x / MOTION_BLOCK_SIZE] += std::abs(p_dst[x] - p_reference[x]);
+		}
+	}
+}
+
+void downsample_rows(const uint8_t *p_row0, const uint8_t *p_row1, int p_dst_width, int p_channels, uint8_t *p_dst) {
+	for (int x = 0; x < p_dst_width; x++) {
+		for (int c = 0; c < p_channels; c++) {
+			*p_dst++ = (p_row0[c] + p_row0[p_channels + c] + p_row1[c] + p_row1[p_channels + c] + 2) >> 2;
+		}
+		p_row0 += p_channels * 2;
+		p_row1 += p_channels * 2;
+	}
+}
+
+int get_packed_pixel_size(PackedLayout p_layout) {
+	static const int pixel_sizes[] = { 1, 3, 3, 4, 4 };
+	return pixel_sizes[p_layout];
+}
+
+bool convert_packed(const FrameDescriptor &p_frame, PackedLayout p_layout, const OutputSpan &p_output) {
+	int width = p_frame.width;
+	int row_size = width * get_packed_pixel_size(p_layout);
+	if (!p_frame.covers(row_size) || p_output.length < size_t(row_size) * p_frame.height) {
+		return false;
+	}
+
+	for (int y = 0; y < p_frame.height; y++) {
+		const uint8_t *src_row = p_frame.row(y);
+		uint8_t *dst_row = p_output.data + size_t(y) * row_size;
+		int x = 0;
+		switch (p_layout) {
+			case PACKED_GRAY8:
+			case PACKED_RGB:
+				memcpy(dst_row, src_row, row_size);
+				break;
+			case PACKED_BGR:
+				for (; x < width; x++) {
+					dst_row[x * 3 + 0] = src_row[x * 3 + 2];
+					dst_row[x * 3 + 1] = src_row[x * 3 + 1];
+					dst_row[x * 3 + 2] = src_row[x * 3 + 0];
+				}
+				break;
+			case PACKED_RGBX:
+			case PACKED_BGRX: {
+				// The padding byte is undefined, alpha is forced opaque.
+				bool swap = p_layout == PACKED_BGRX;
+#ifdef __SSE2__
+				const __m128i alpha = _mm_set1_epi32(int(0xff000000));
+				const __m128i red_blue_mask = _mm_set1_epi32(0x00ff00ff);
+				const __m128i green_mask = _mm_set1_epi32(0x0000ff00);
+				for (; x + 4 <= width; x += 4) {
+					__m128i pixels = _mm_loadu_si128((const __m128i *)(src_row + x * 4));
+					if (swap) {
+						// Swapping the 16 bit halves of each pixel swaps its first and third byte.
+						__m128i red_blue = _mm_and_si128(pixels, red_blue_mask);
+						red_blue = _mm_shufflehi_epi16(_mm_shufflelo_epi16(red_blue, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+						pixels = _mm_or_si128(red_blue, _mm_and_si128(pixels, green_mask));
+					}
+					_mm_storeu_si128((__m128i *)(dst_row + x * 4), _mm_or_si128(pixels, alpha));
+				}
+#endif
+				for (; x < width; x++) {
+					dst_row[x * 4 + 0] = src_row[x * 4 + (swap ? 2 : 0)];
+					dst_row[x * 4 + 1] = src_row[x * 4 + 1];
+					dst_row[x * 4 + 2] = src_row[x * 4 + (swap ? 0 : 2)];
+					dst_row[x * 4 + 3] = 255;
+				}
+			} break;
+		}
+	}
+	return true;
+}
+
+bool copy_rows(const FrameDescriptor &p_frame, int p_row_size, const OutputSpan &p_output) {
+	if (!p_frame.covers(p_row_size) || p_output.length < size_t(p_row_size) * p_frame.height) {
+		return false;
+	}
+	if (p_frame.stride == p_row_size) {
+		memcpy(p_output.data, p_frame.data, size_t(p_row_size) * p_frame.height);
+		return true;
+	}
+	for (int y = 0; y < p_frame.height; y++) {
+		memcpy(p_output.data + size_t(y) * p_row_size, p_frame.row(y), p_row_size);
+	}
+	return true;
+}
+
+uint16_t make_half_float(float p_value) {
+	uint32_t bits;
+	memcpy(&bits, &p_value, sizeof(bits));
+	uint16_t sign = (bits >> 16) & 0x8000;
+	int exponent = int((bits >> 23) & 0xff);
+	uint32_t mantissa = bits & 0x7fffff;
+	if (exponent == 0xff) {
+		// Infinity stays infinity, NaN stays NaN.
+		return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+	}
+	exponent += 15 - 127;
+	if (exponent >= 31) {
+		return sign | 0x7c00;
+	}
+	if (exponent <= 0) {
+		if (exponent < -10) {
+			return sign;
+		}
+		// Subnormal, the implicit leading bit becomes part of the mantissa.
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		return sign | ((mantissa >> shift) + ((mantissa >> (shift - 1)) & 1));
+	}
+	// A carry out of the mantissa correctly rounds up into the exponent.
+	return (sign | (exponent << 10) | (mantissa >> 13)) + ((mantissa >> 12) & 1);
+}
+
+bool convert_gray16(const FrameDescriptor &p_frame, const uint16_t *p_table, const OutputSpan &p_output) {
+	if (!p_frame.covers(p_frame.width * 2) || p_output.length < size_t(p_frame.width) * p_frame.height * 2) {
+		return false;
+	}
+	uint16_t *dst = (uint16_t *)p_output.data;
+	for (int y = 0; y < p_frame.height; y++) {
+		const uint8_t *src = p_frame.row(y);
+		for (int x = 0; x < p_frame.width; x++) {
+			*dst++ = p_table[src[x * 2] | (src[x * 2 + 1] << 8)];
+		}
+	}
+	return true;
+}
+
+bool convert_gray16(const FrameDescriptor &p_frame, const uint8_t *p_table, const OutputSpan &p_output) {
+	if (!p_frame.covers(p_frame.width * 2) || p_output.length < size_t(p_frame.width) * p_frame.height) {
+		return false;
+	}
+	uint8_t *dst = p_output.data;
+	for (int y = 0; y < p_frame.height; y++) {
+		const uint8_t *src = p_frame.row(y);
+		for (int x = 0; x < p_frame.width; x++) {
+			*dst++ = p_table[src[x * 2] | (src[x * 2 + 1] << 8)];
+		}
+	}
+	return true;
+}
+
+bool convert_gray16(const FrameDescriptor &p_frame, float p_range_min, float p_range_scale, const OutputSpan &p_output) {
+	if (!p_frame.covers(p_frame.width * 2) || p_output.length < size_t(p_frame.width) * p_frame.height * 4) {
+		return false;
+	}
+	float *dst = (float *)p_output.data;
+	for (int y = 0; y < p_frame.height; y++) {
+		const uint8_t *src = p_frame.row(y);
+		for (int x = 0; x < p_frame.width; x++) {
+			*dst++ = ((src[x * 2] | (src[x * 2 + 1] << 8)) - p_range_min) * p_range_scale;
+		}
+	}
+	return true;
+}
+
+// Bilinear interpolation of one pixel, also used for the border columns of the SSE2 path.
+static inline void demosaic_pixel(const uint8_t *p_mid, const uint8_t *p_up, const uint8_t *p_down, int p_x, int p_width, bool p_red_row, bool p_red_column, uint8_t *p_dst) {
+	// Edges are mirrored, which keeps the colour of neighbouring samples.
+	int left = p_x > 0 ? p_x - 1 : p_x + 1;
+	int right = p_x < p_width - 1 ? p_x + 1 : p_x - 1;
+	// Every candidate is computed and then selected, so the loop has no data dependent branches.
+	int center = p_mid[p_x];
+	int horizontal = (p_mid[left] + p_mid[right] + 1) >> 1;
+	int vertical = (p_up[p_x] + p_down[p_x] + 1) >> 1;
+	int cross = (p_mid[left] + p_mid[right] + p_up[p_x] + p_down[p_x] + 2) >> 2;
+	int diagonal = (p_up[left] + p_up[right] + p_down[left] + p_down[right] + 2) >> 2;
+	if (p_red_row) {
+		p_dst[0] = p_red_column ? center : horizontal;
+		p_dst[1] = p_red_column ? cross : center;
+		p_dst[2] = p_red_column ? diagonal : vertical;
+	} else {
+		p_dst[0] = p_red_column ? vertical : diagonal;
+		p_dst[1] = p_red_column ? center : cross;
+		p_dst[2] = p_red_column ? horizontal : center;
+	}
+}
+
+#ifdef __SSE2__
+static inline __m128i select_bytes(__m128i p_mask, __m128i p_a, __m128i p_b) {
+	return _mm_or_si128(_mm_and_si128(p_mask, p_a), _mm_andnot_si128(p_mask, p_b));
+}
+
+// Summed in 16 bits, so it rounds like the scalar code, which averaging pairs would not.
+static inline __m128i average4(__m128i p_a, __m128i p_b, __m128i p_c, __m128i p_d) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i two = _mm_set1_epi16(2);
+	__m128i low = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(p_a, zero), _mm_unpacklo_epi8(p_b, zero)), _mm_add_epi16(_mm_unpacklo_epi8(p_c, zero), _mm_unpacklo_epi8(p_d, zero)));
+	__m128i high = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(p_a, zero), _mm_unpackhi_epi8(p_b, zero)), _mm_add_epi16(_mm_unpackhi_epi8(p_c, zero), _mm_unpackhi_epi8(p_d, zero)));
+	low = _mm_srli_epi16(_mm_add_epi16(low, two), 2);
+	high = _mm_srli_epi16(_mm_add_epi16(high, two), 2);
+	return _mm_packus_epi16(low, high);
+}
+
+// Interleaves 16 pixels into 48 bytes. Each pair of pixels is written with 8 bytes, the last
+// two of which belong to the next pixel and are overwritten by it or later by the caller.
+static inline void store_rgb(__m128i p_red, __m128i p_green, __m128i p_blue, uint8_t *p_dst) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i low_pixel = _mm_set1_epi64x(0x0000000000ffffff);
+	const __m128i high_pixel = _mm_set1_epi64x(0x0000ffffff000000);
+	__m128i red_green[2] = { _mm_unpacklo_epi8(p_red, p_green), _mm_unpackhi_epi8(p_red, p_green) };
+	__m128i blue_zero[2] = { _mm_unpacklo_epi8(p_blue, zero), _mm_unpackhi_epi8(p_blue, zero) };
+	for (int i = 0; i < 4; i++) {
+		__m128i pixels = (i & 1) ? _mm_unpackhi_epi16(red_green[i >> 1], blue_zero[i >> 1]) : _mm_unpacklo_epi16(red_green[i >> 1], blue_zero[i >> 1]);
+		// Moves the second pixel of each 64 bit half next to the first one.
+		pixels = _mm_or_si128(_mm_and_si128(pixels, low_pixel), _mm_and_si128(_mm_srli_epi64(pixels, 8), high_pixel));
+		_mm_storel_epi64((__m128i *)(p_dst + i * 12), pixels);
+		_mm_storel_epi64((__m128i *)(p_dst + i * 12 + 6), _mm_unpackhi_epi64(pixels, pixels));
+	}
+}
+#endif
+
+bool demosaic_bayer(const FrameDescriptor &p_frame, int p_red_x, int p_red_y, const OutputSpan &p_output) {
+	int width = p_frame.width;
+	int height = p_frame.height;
+	if (width < 2 || height < 2 || !p_frame.covers(width) || p_output.length < size_t(width) * height * 3) {
+		return false;
+	}
+#ifdef __SSE2__
+	// Blocks start at odd columns, so red columns are every other byte starting with the first or second.
+	const __m128i red_columns = _mm_set1_epi16(p_red_x ? 0x00ff : int16_t(0xff00));
+#endif
+	for (int y = 0; y < height; y++) {
+		const uint8_t *mid = p_frame.row(y);
+		const uint8_t *up = p_frame.row(y > 0 ? y - 1 : y + 1);
+		const uint8_t *down = p_frame.row(y < height - 1 ? y + 1 : y - 1);
+		uint8_t *dst = p_output.data + size_t(y) * width * 3;
+		bool red_row = (y & 1) == p_red_y;
+		demosaic_pixel(mid, up, down, 0, width, red_row, p_red_x == 0, dst);
+		int x = 1;
+#ifdef __SSE2__
+		// Interior columns have both neighbours. The last column is left to the scalar code, which keeps
+		// the two bytes store_rgb() writes past a block inside the row.
+		for (; x + 16 < width; x += 16) {
+			__m128i center = _mm_loadu_si128((const __m128i *)(mid + x));
+			__m128i left = _mm_loadu_si128((const __m128i *)(mid + x - 1));
+			__m128i right = _mm_loadu_si128((const __m128i *)(mid + x + 1));
+			__m128i top = _mm_loadu_si128((const __m128i *)(up + x));
+			__m128i bottom = _mm_loadu_si128((const __m128i *)(down + x));
+			__m128i horizontal = _mm_avg_epu8(left, right);
+			__m128i vertical = _mm_avg_epu8(top, bottom);
+			__m128i cross = average4(left, right, top, bottom);
+			__m128i diagonal = average4(
+					_mm_loadu_si128((const __m128i *)(up + x - 1)), _mm_loadu_si128((const __m128i *)(up + x + 1)),
+					_mm_loadu_si128((const __m128i *)(down + x - 1)), _mm_loadu_si128((const __m128i *)(down + x + 1)));
+			__m128i red, green, blue;
+			if (red_row) {
+				red = select_bytes(red_columns, center, horizontal);
+				green = select_bytes(red_columns, cross, center);
+				blue = select_bytes(red_columns, diagonal, vertical);
+			} else {
+				red = select_bytes(red_columns, vertical, diagonal);
+				green = select_bytes(red_columns, center, cross);
+				blue = select_bytes(red_columns, horizontal, center);
+			}
+			store_rgb(red, green, blue, dst + x * 3);
+		}
+#endif
+		for (; x < width; x++) {
+			demosaic_pixel(mid, up, down, x, width, red_row, (x & 1) == p_red_x, dst + x * 3);
+		}
+	}
+	return true;
+}
+
+bool bin_bayer(const FrameDescriptor &p_frame, int p_red_x, int p_red_y, const OutputSpan &p_output) {
+	int width = p_frame.width;
+	int height = p_frame.height;
+	if (width < 2 || height < 2 || !p_frame.covers(width) || p_output.length < size_t(width / 2) * (height / 2) * 3) {
+		return false;
+	}
+	uint8_t *dst = p_output.data;
+	for (int y = 0; y < height / 2; y++) {
+		const uint8_t *red_row = p_frame.row(y * 2 + p_red_y);
+		const uint8_t *blue_row = p_frame.row(y * 2 + (p_red_y ^ 1));
+		const uint8_t *red = red_row + p_red_x;
+		const uint8_t *blue = blue_row + (p_red_x ^ 1);
+		const uint8_t *green0 = red_row + (p_red_x ^ 1);
+		const uint8_t *green1 = blue_row + p_red_x;
+		for (int x = 0; x < width / 2; x++) {
+			*dst++ = red[x * 2];
+			*dst++ = (green0[x * 2] + green1[x * 2] + 1) >> 1;
+			*dst++ = blue[x * 2];
+		}
+	}
+	return true;
+}
+
+} // namespace frame_kernels
@@ -0,0 +1,68 @@
+#ifndef FRAME_KERNELS_H
+#define FRAME_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Pixel conversion kernels shared by the BufferDecoder classes. Nothing in here depends on
+// Godot, so the kernels can be built, tested and benchmarked on their own.
+namespace frame_kernels {
+
+constexpr int MOTION_BLOCK_SIZE = 16;
+
+// A captured frame, rows start stride bytes apart.
+struct FrameDescriptor {
+	const uint8_t *data = nullptr;
+	size_t length = 0;
+	int width = 0;
+	int height = 0;
+	int stride = 0;
+
+	// Whether data holds height rows of at least p_row_size bytes.
+	bool covers(int p_row_size) const;
+	const uint8_t *row(int p_y) const { return data + size_t(p_y) * stride; }
+};
+
+// Destination of a conversion, rows are tightly packed.
+struct OutputSpan {
+	uint8_t *data = nullptr;
+	size_t length = 0;
+};
+
+enum PackedLayout {
+	PACKED_GRAY8,
+	PACKED_RGB,
+	PACKED_BGR,
+	PACKED_RGBX,
+	PACKED_BGRX,
+};
+
+// p_indexes are the offsets of Y0, Y1, U and V in each 4 byte pixel pair.
+void yuyv_row_to_rgb(const uint8_t *p_src, const int *p_indexes, int p_width, uint8_t *p_dst);
+void yuyv_row_to_grayscale(const uint8_t *p_src, const int *p_indexes, int p_width, uint8_t *p_dst);
+// Copies the luma of a YUYV row (at even bytes with offset 0, odd with 1) to p_dst. With a reference
+// row, the absolute differences of each MOTION_BLOCK_SIZE wide block are added to r_block_sums.
+void extract_luma_row(const uint8_t *p_src, int p_offset, int p_width, uint8_t *p_dst, const uint8_t *p_reference, uint32_t *r_block_sums);
+// Averages each 2x2 block of two rows into one pixel of p_dst.
+void downsample_rows(const uint8_t *p_row0, const uint8_t *p_row1, int p_dst_width, int p_channels, uint8_t *p_dst);
+
+// Output bytes per pixel, padded layouts become RGBA with opaque alpha.
+int get_packed_pixel_size(PackedLayout p_layout);
+bool convert_packed(const FrameDescriptor &p_frame, PackedLayout p_layout, const OutputSpan &p_output);
+bool copy_rows(const FrameDescriptor &p_frame, int p_row_size, const OutputSpan &p_output);
+
+// Rounds to the nearest half float, out of range values become infinity.
+uint16_t make_half_float(float p_value);
+// 16-bit little endian samples, looked up in a table of 65536 entries or normalized to float.
+bool convert_gray16(const FrameDescriptor &p_frame, const uint16_t *p_table, const OutputSpan &p_output);
+bool convert_gray16(const FrameDescriptor &p_frame, const uint8_t *p_table, const OutputSpan &p_output);
+bool convert_gray16(const FrameDescriptor &p_frame, float p_range_min, float p_range_scale, const OutputSpan &p_output);
+
+// 8-bit Bayer to RGB8, the pattern is given by the position of the red sample in each 2x2 cell.
+bool demosaic_bayer(const FrameDescriptor &p_frame, int p_red_x, int p_red_y, const OutputSpan &p_output);
+// One RGB8 pixel per 2x2 cell.
+bool bin_bayer(const FrameDescriptor &p_frame, int p_red_x, int p_red_y, const OutputSpan &p_output);
+
+} // namespace frame_kernels
+
+#endif // FRAME_KERNELS_H
@@ -1,8 +1,15 @@
 #include "camera_feed_linux.h"
 
+#include <cstdio>
+#include <ctime>
+#include <thread>
+
 #include <pipewire/pipewire.h>
+#include <spa/buffer/meta.h>
 #include <spa/debug/types.h>
 #include <spa/param/video/format-utils.h>
+#include <spa/utils/keys.h>
+#include <spa/utils/result.h>
 
 #include "godot_cpp/classes/image.hpp"
 
@@ -15,12 +22,25 @@ static void on_node_info(void *data, const struct pw_node_info *info) {
 		return;
 	}
 
+	bool changed = false;
 	for (int i = 0; i < info->n_params; i++) {
 		spa_param_info *param = &info->params[i];
-		if (!(param->flags & SPA_PARAM_INFO_READ)) {
+		if (param->id != SPA_PARAM_EnumFormat || !(param->flags & SPA_PARAM_INFO_READ)) {
+			continue;
+		}
+		// The serial flag toggles whenever the node updates the param.
+		uint32_t *flags = feed->param_flags.getptr(param->id);
+		if (flags && *flags == param->flags) {
 			continue;
 		}
-		pw_node_enum_params(feed->node, ++param->seq, param->id, 0, -1, nullptr);
+		feed->param_flags[param->id] = param->flags;
+		pw_node_enum_params(feed->node, 0, param->id, 0, -1, nullptr);
+		changed = true;
+	}
+	if (changed) {
+		feed->format_generation++;
+		feed->format_sync_seq = pw_proxy_sync(feed->proxy, 0);
+		feed->formats_sync_failed = false;
 	}
 }
 
@@ -51,12 +71,36 @@ static void on_node_param(void *data, int seq, uint32_t id, uint32_t index, uint
 			case SPA_VIDEO_FORMAT_YVYU:
 			case SPA_VIDEO_FORMAT_UYVY:
 			case SPA_VIDEO_FORMAT_VYUY:
+			case SPA_VIDEO_FORMAT_GRAY16_LE:
+			case SPA_VIDEO_FORMAT_GRAY8:
+			case SPA_VIDEO_FORMAT_RGB:
+			case SPA_VIDEO_FORMAT_BGR:
+			case SPA_VIDEO_FORMAT_RGBx:
+			case SPA_VIDEO_FORMAT_BGRx:
 				format = info.format;
 				resolution = info.size;
 				break;
 			default:
 				return;
 		}
+	} else if (media_subtype == SPA_MEDIA_SUBTYPE_mjpg) {
+		spa_video_info_mjpg info = {};
+		spa_format_video_mjpg_parse(param, &info);
+		format = SPA_VIDEO_FORMAT_UNKNOWN;
+		resolution = info.size;
+	} else if (media_subtype == SPA_MEDIA_SUBTYPE_bayer) {
+		// There is no parser for Bayer formats, and the pattern is not part of the format.
+		if (spa_pod_parse_object(param, SPA_TYPE_OBJECT_Format, nullptr, SPA_FORMAT_VIDEO_size, SPA_POD_Rectangle(&resolution)) < 0) {
+			return;
+		}
+		format = SPA_VIDEO_FORMAT_UNKNOWN;
+#ifdef FFMPEG_ENABLED
+	} else if (media_subtype == SPA_MEDIA_SUBTYPE_h264) {
+		spa_video_info_h264 info = {};
+		spa_format_video_h264_parse(param, &info);
+		format = SPA_VIDEO_FORMAT_UNKNOWN;
+		resolution = info.size;
+#endif
 	} else {
 		return;
 	}
@@ -70,11 +114,25 @@ static void on_node_param(void *data, int seq, uint32_t id, uint32_t index, uint
 		return;
 	}
 	framerate_values = (spa_fraction *)SPA_POD_BODY(framerate_pod);
-	if (framerate_choice == SPA_CHOICE_Enum) {
-		// Index 0 is the default.
-		for (int i = 1; i < n_framerates; i++) {
-			feed->add_format(media_subtype, format, resolution, framerate_values[i]);
-		}
+	switch (framerate_choice) {
+		case SPA_CHOICE_None:
+			feed->add_format(media_subtype, format, resolution, framerate_values[0], framerate_values[0], framerate_values[0]);
+			break;
+		case SPA_CHOICE_Enum:
+			// Index 0 is the default.
+			for (int i = 1; i < n_framerates; i++) {
+				feed->add_format(media_subtype, format, resolution, framerate_values[i], framerate_values[i], framerate_values[i]);
+			}
+			break;
+		case SPA_CHOICE_Range:
+		case SPA_CHOICE_Step:
+			// Values are default, min, max and optionally step.
+			if (n_framerates >= 3) {
+				feed->add_format(media_subtype, format, resolution, framerate_values[0], framerate_values[1], framerate_values[2]);
+			}
+			break;
+		default:
+			break;
 	}
 }
 
@@ -82,6 +140,20 @@ static void on_proxy_destroy(void *data) {
 	CameraFeedLinux *feed = (CameraFeedLinux *)data;
 	feed->proxy = nullptr;
 	feed->node = nullptr;
+	if (!feed->formats_synced) {
+		// Nothing will answer the sync anymore.
+		feed->formats_sync_failed = true;
+		pw_thread_loop_signal(CameraServerLinux::get_loop(), false);
+	}
+}
+
+static void on_proxy_done(void *data, int seq) {
+	CameraFeedLinux *feed = (CameraFeedLinux *)data;
+	if (seq == feed->format_sync_seq) {
+		feed->expire_formats();
+		feed->formats_synced = true;
+		pw_thread_loop_signal(CameraServerLinux::get_loop(), false);
+	}
 }
 
 static void on_stream_destroy(void *data) {
@@ -89,6 +161,158 @@ static void on_stream_destroy(void *data) {
 	feed->stream = nullptr;
 }
 
+static void on_stream_state_changed(void *data, enum pw_stream_state old, enum pw_stream_state state, const char *error) {
+	CameraFeedLinux *feed = (CameraFeedLinux *)data;
+	if (!feed->activation_pending) {
+		return;
+	}
+	if (state == PW_STREAM_STATE_STREAMING) {
+		feed->activation_pending = false;
+		if (!feed->format_negotiated) {
+			feed->emit_activation_failed("Stream started without a negotiated format.");
+			return;
+		}
+		if (feed->decoder == nullptr) {
+			// param_changed could not build a decoder for what was negotiated.
+			feed->emit_activation_failed("Negotiated format cannot be decoded.");
+			return;
+		}
+		Dictionary format = feed->format_to_dictionary(feed->negotiated_format);
+		format.erase("available");
+		format["output"] = CameraFeedLinux::output_names[feed->selected_output];
+		feed->emit_activated(format);
+	} else if (state == PW_STREAM_STATE_ERROR) {
+		feed->activation_pending = false;
+		feed->emit_activation_failed(error ? error : "Stream error.");
+	}
+}
+
+static void on_activation_timeout(void *data, uint64_t expirations) {
+	CameraFeedLinux *feed = (CameraFeedLinux *)data;
+	if (!feed->activation_pending) {
+		return;
+	}
+	// A busy device leaves the stream paused without an error.
+	feed->activation_pending = false;
+	feed->emit_activation_failed("Stream did not start, the device may be in use.");
+}
+
+static void on_stream_param_changed(void *data, uint32_t id, const struct spa_pod *param) {
+	CameraFeedLinux *feed = (CameraFeedLinux *)data;
+	if (id != SPA_PARAM_Format || param == nullptr) {
+		return;
+	}
+	uint32_t media_type, media_subtype;
+	if (spa_format_parse(param, &media_type, &media_subtype) < 0 || media_type != SPA_MEDIA_TYPE_video) {
+		return;
+	}
+	// The node may settle on something other than what was requested, decoders follow the negotiated format.
+	CameraFeedLinux::FeedFormat negotiated = {};
+	negotiated.media_subtype = media_subtype;
+	spa_video_info info = {};
+	switch (media_subtype) {
+		case SPA_MEDIA_SUBTYPE_raw:
+			if (spa_format_video_raw_parse(param, &info.info.raw) < 0) {
+				return;
+			}
+			negotiated.format = info.info.raw.format;
+			negotiated.resolution = info.info.raw.size;
+			negotiated.framerate = info.info.raw.framerate;
+			break;
+		case SPA_MEDIA_SUBTYPE_mjpg:
+			if (spa_format_video_mjpg_parse(param, &info.info.mjpg) < 0) {
+				return;
+			}
+			negotiated.resolution = info.info.mjpg.size;
+			negotiated.framerate = info.info.mjpg.framerate;
+			break;
+		case SPA_MEDIA_SUBTYPE_h264:
+			if (spa_format_video_h264_parse(param, &info.info.h264) < 0) {
+				return;
+			}
+			negotiated.resolution = info.info.h264.size;
+			negotiated.framerate = info.info.h264.framerate;
+			break;
+		case SPA_MEDIA_SUBTYPE_bayer:
+			if (spa_pod_parse_object(param, SPA_TYPE_OBJECT_Format, nullptr,
+						SPA_FORMAT_VIDEO_size, SPA_POD_Rectangle(&negotiated.resolution),
+						SPA_FORMAT_VIDEO_framerate, SPA_POD_OPT_Fraction(&negotiated.framerate)) < 0) {
+				return;
+			}
+			break;
+		default:
+			break;
+	}
+	negotiated.framerate_min = negotiated.framerate;
+	negotiated.framerate_max = negotiated.framerate;
+	feed->negotiated_format = negotiated;
+	feed->format_negotiated = true;
+
+	std::unique_lock<std::shared_mutex> decoder_lock(feed->decoder_mutex);
+	bool changed = feed->decoder != nullptr && !feed->decoder_format.is_layout_equal(negotiated);
+	if (feed->pending_decoder) {
+		// A live format switch completed, no frame of the old format can arrive anymore.
+		memdelete(feed->decoder);
+		feed->decoder = feed->pending_decoder;
+		feed->decoder_format = feed->pending_format;
+		feed->pending_decoder = nullptr;
+		changed = true;
+	}
+	if (feed->decoder == nullptr || !feed->decoder_format.is_layout_equal(negotiated)) {
+		if (feed->decoder) {
+			memdelete(feed->decoder);
+		}
+		feed->decoder = feed->create_decoder(negotiated, feed->selected_output, feed->decoder_settings);
+		if (feed->decoder == nullptr) {
+			WARN_PRINT("Negotiated format is not supported, frames are dropped.");
+		}
+	}
+	feed->decoder_format = negotiated;
+	if (feed->decoder && feed->reserved_size > 0) {
+		feed->decoder->reserve_pending(feed->reserved_size);
+	}
+	decoder_lock.unlock();
+	if (changed) {
+		feed->this_->call_deferred("emit_signal", "format_changed");
+	}
+	// Buffers and metadata can only be negotiated once the format is fixed.
+	feed->update_buffer_params();
+}
+
+static void on_stream_add_buffer(void *data, struct pw_buffer *buffer) {
+	CameraFeedLinux *feed = (CameraFeedLinux *)data;
+	buffer->user_data = memnew(CameraFeedLinux::Lease(feed, buffer));
+	if (feed->rt_process && buffer->buffer->n_datas > 0 && buffer->buffer->datas[0].maxsize > feed->reserved_size) {
+		feed->reserved_size = buffer->buffer->datas[0].maxsize;
+		if (feed->decoder) {
+			feed->decoder->reserve_pending(feed->reserved_size);
+		}
+	}
+}
+
+static void on_stream_remove_buffer(void *data, struct pw_buffer *buffer) {
+	CameraFeedLinux *feed = (CameraFeedLinux *)data;
+	CameraFeedLinux::Lease *lease = (CameraFeedLinux::Lease *)buffer->user_data;
+	if (lease == nullptr) {
+		return;
+	}
+	// The memory goes away with the buffer, decoders still holding it take a copy instead.
+	lease->buffer = nullptr;
+	if (feed->decoder) {
+		feed->decoder->detach_pending();
+	}
+	if (feed->pending_decoder) {
+		feed->pending_decoder->detach_pending();
+	}
+	buffer->user_data = nullptr;
+	if (lease->in_use) {
+		// Other holders still refer to the lease, the last one to release it frees it.
+		lease->orphaned = true;
+	} else {
+		memdelete(lease);
+	}
+}
+
 static void on_stream_process(void *data) {
 	pw_buffer *b = nullptr;
 	spa_buffer *buf = nullptr;
@@ -99,12 +323,21 @@ static void on_stream_process(void *data) {
 		return;
 	}
 
+	// Only the newest frame is decoded, except for inter-coded formats where each one references
+	// the previous. Those are fed to the decoder in order and only the newest is presented.
+	bool every_frame = !feed->rt_process && feed->decoder && feed->decoder->requires_every_frame();
 	while (true) {
 		pw_buffer *t;
 		if ((t = pw_stream_dequeue_buffer(stream)) == nullptr) {
 			break;
 		}
 		if (b) {
+			if (every_frame) {
+				StreamingBuffer skipped;
+				skipped.start = b->buffer->datas[0].data;
+				skipped.length = b->buffer->datas[0].chunk->size;
+				feed->decoder->submit(skipped, 0, true);
+			}
 			pw_stream_queue_buffer(stream, b);
 		}
 		b = t;
@@ -117,7 +350,57 @@ static void on_stream_process(void *data) {
 	buf = b->buffer;
 	feed->buffer->start = buf->datas[0].data;
 	feed->buffer->length = buf->datas[0].chunk->size;
-	feed->decoder->decode(*feed->buffer);
+	feed->buffer->stride = buf->datas[0].chunk->stride;
+	uint64_t timestamp;
+	spa_meta_header *header = (spa_meta_header *)spa_buffer_find_meta_data(buf, SPA_META_Header, sizeof(spa_meta_header));
+	if (header && header->pts > 0) {
+		timestamp = header->pts / 1000;
+	} else {
+		timestamp = pw_stream_get_nsec(stream) / 1000;
+	}
+	uint64_t capture_usec = header && header->pts > 0 ? timestamp : 0;
+
+	if (feed->rt_process) {
+		// Realtime thread, without the loop lock. The frame is only copied into the slot reserved
+		// in add_buffer and the buffer handed back right away, decoding happens on the loop thread.
+		// A decoder being replaced is never waited for, the frame is dropped instead.
+		std::shared_lock<std::shared_mutex> decoder_lock(feed->decoder_mutex, std::try_to_lock);
+		if (decoder_lock.owns_lock()) {
+			feed->buffer->lease = nullptr;
+			feed->dispatch_frame(feed->decoder, *feed->buffer, 0, timestamp, true);
+			feed->pending_capture_usec = capture_usec;
+		}
+		pw_stream_queue_buffer(stream, b);
+		if (decoder_lock.owns_lock()) {
+			decoder_lock.unlock();
+			// Never waits for other threads queueing, a frame not decoded here stays pending for the
+			// next one or request_frame().
+			CameraServerLinux::try_invoke(CameraFeedLinux::do_decode_pending, feed);
+		}
+		return;
+	}
+
+	CameraFeedLinux::Lease *lease = (CameraFeedLinux::Lease *)b->user_data;
+	feed->buffer->lease = lease;
+	if (lease) {
+		lease->in_use = true;
+		lease->reference();
+	}
+	bool decoded = feed->dispatch_frame(feed->decoder, *feed->buffer, 0, timestamp);
+	if (lease) {
+		// Requeued here unless a consumer kept a reference to read it later.
+		lease->unreference();
+	} else {
+		pw_stream_queue_buffer(stream, b);
+	}
+	if (decoded) {
+		uint64_t now = pw_stream_get_nsec(stream) / 1000;
+		if (capture_usec > 0 && now >= capture_usec) {
+			feed->record_latency(now - capture_usec);
+		}
+	} else {
+		feed->pending_capture_usec = capture_usec;
+	}
 }
 
 static const struct pw_node_events node_events = {
@@ -129,24 +412,70 @@ static const struct pw_node_events node_events = {
 static const struct pw_proxy_events proxy_events = {
 	.version = PW_VERSION_PROXY_EVENTS,
 	.destroy = on_proxy_destroy,
+	.done = on_proxy_done,
 };
 
 static const struct pw_stream_events stream_events = {
 	.version = PW_VERSION_STREAM_EVENTS,
 	.destroy = on_stream_destroy,
+	.state_changed = on_stream_state_changed,
+	.param_changed = on_stream_param_changed,
+	.add_buffer = on_stream_add_buffer,
+	.remove_buffer = on_stream_remove_buffer,
 	.process = on_stream_process,
 };
 
+CameraFeedLinux::Lease::Lease(CameraFeedLinux *p_feed, pw_buffer *p_buffer) :
+		feed(p_feed), buffer(p_buffer) {}
+
+void CameraFeedLinux::Lease::release() {
+	pw_thread_loop *loop = CameraServerLinux::get_loop();
+	if (loop == nullptr) {
+		return;
+	}
+	// Runs right away on the loop thread, other threads queue it without taking the loop lock.
+	CameraServerLinux::invoke(do_release, this);
+}
+
+int CameraFeedLinux::Lease::do_release(struct spa_loop *loop, bool async, uint32_t seq, const void *data, size_t size, void *user_data) {
+	Lease *lease = (Lease *)user_data;
+	if (lease->orphaned) {
+		memdelete(lease);
+		return 0;
+	}
+	lease->in_use = false;
+	if (lease->buffer && lease->feed->stream) {
+		pw_stream_queue_buffer(lease->feed->stream, lease->buffer);
+	}
+	return 0;
+}
+
+const char *CameraFeedLinux::output_names[OUTPUT_MAX] = { "rgb", "grayscale", "copy", "rh", "rf" };
+const char *CameraFeedLinux::bayer_pattern_names[BAYER_PATTERN_MAX] = { "rggb", "bggr", "grbg", "gbrg" };
+
 CameraFeedLinux::CameraFeedLinux(CameraFeedExtension *feed) :
 		extension::CameraFeed(feed) {}
 
-CameraFeedLinux::CameraFeedLinux(uint32_t id, const char *name, pw_proxy *proxy, pw_stream *stream) :
-		id(id), name(name), proxy(proxy), stream(stream) {
+CameraFeedLinux::CameraFeedLinux(uint32_t id, uint32_t version, const spa_dict *props, pw_core *core, pw_registry *registry) :
+		id(id), version(version), core(core), registry(registry) {
+	static const char *summary_keys[] = {
+		PW_KEY_NODE_NAME,
+		PW_KEY_NODE_DESCRIPTION,
+		PW_KEY_NODE_NICK,
+		PW_KEY_MEDIA_CLASS,
+		PW_KEY_MEDIA_ROLE,
+		PW_KEY_OBJECT_PATH,
+		SPA_KEY_DEVICE_API,
+	};
 	buffer = new StreamingBuffer();
-	node = (pw_node *)proxy;
-	pw_node_add_listener(node, &node_listener, &node_events, this);
-	pw_proxy_add_listener(proxy, &proxy_listener, &proxy_events, this);
-	pw_stream_add_listener(stream, &stream_listener, &stream_events, this);
+	name = String::utf8(spa_dict_lookup(props, PW_KEY_NODE_DESCRIPTION));
+	node_name = String::utf8(spa_dict_lookup(props, PW_KEY_NODE_NAME));
+	for (const char *key : summary_keys) {
+		const char *value = spa_dict_lookup(props, key);
+		if (value) {
+			summary[key] = String::utf8(value);
+		}
+	}
 }
 
 CameraFeedLinux::~CameraFeedLinux() {
@@ -157,26 +486,492 @@ CameraFeedLinux::~CameraFeedLinux() {
 	if (loop == nullptr) {
 		return;
 	}
+	// Waits until queued connects and disconnects ran, they still refer to this feed. The invoke
+	// itself does not block, which would hold up other threads queueing meanwhile.
 	pw_thread_loop_lock(loop);
-	if (stream) {
-		pw_stream_destroy(stream);
-	}
-	if (proxy) {
-		pw_proxy_destroy(proxy);
+	if (CameraServerLinux::invoke(do_destroy, this) >= 0) {
+		while (!destroyed) {
+			pw_thread_loop_wait(loop);
+		}
 	}
 	pw_thread_loop_unlock(loop);
 	delete buffer;
 }
 
-void CameraFeedLinux::add_format(const uint32_t media_subtype, const uint32_t format, const spa_rectangle resolution, const spa_fraction framerate) {
+bool CameraFeedLinux::FeedFormat::is_layout_equal(const FeedFormat &p_other) const {
+	return media_subtype == p_other.media_subtype && format == p_other.format &&
+			resolution.width == p_other.resolution.width && resolution.height == p_other.resolution.height;
+}
+
+bool CameraFeedLinux::FeedFormat::operator==(const FeedFormat &p_other) const {
+	return media_subtype == p_other.media_subtype && format == p_other.format &&
+			resolution.width == p_other.resolution.width && resolution.height == p_other.resolution.height &&
+			framerate.num == p_other.framerate.num && framerate.denom == p_other.framerate.denom &&
+			framerate_min.num == p_other.framerate_min.num && framerate_min.denom == p_other.framerate_min.denom &&
+			framerate_max.num == p_other.framerate_max.num && framerate_max.denom == p_other.framerate_max.denom;
+}
+
+uint32_t CameraFeedLinux::FeedFormatHasher::hash(const FeedFormat &p_format) {
+	uint32_t h = hash_murmur3_one_32(p_format.media_subtype);
+	h = hash_murmur3_one_32(p_format.format, h);
+	h = hash_murmur3_one_32(p_format.resolution.width, h);
+	h = hash_murmur3_one_32(p_format.resolution.height, h);
+	h = hash_murmur3_one_32(p_format.framerate.num, h);
+	h = hash_murmur3_one_32(p_format.framerate.denom, h);
+	h = hash_murmur3_one_32(p_format.framerate_min.num, h);
+	h = hash_murmur3_one_32(p_format.framerate_min.denom, h);
+	h = hash_murmur3_one_32(p_format.framerate_max.num, h);
+	h = hash_murmur3_one_32(p_format.framerate_max.denom, h);
+	return hash_fmix32(h);
+}
+
+void CameraFeedLinux::add_format(const uint32_t media_subtype, const uint32_t format, const spa_rectangle resolution, const spa_fraction framerate, const spa_fraction framerate_min, const spa_fraction framerate_max) {
 	FeedFormat feed_format = {};
 	feed_format.media_subtype = media_subtype;
 	feed_format.format = format;
 	feed_format.resolution = resolution;
 	feed_format.framerate = framerate;
+	feed_format.framerate_min = framerate_min;
+	feed_format.framerate_max = framerate_max;
+	feed_format.generation = format_generation;
+
+	int *index = format_indexes.getptr(feed_format);
+	if (index) {
+		FeedFormat &existing = formats.write[*index];
+		existing.generation = format_generation;
+		if (!existing.available) {
+			existing.available = true;
+			formats_dirty = true;
+		}
+		return;
+	}
+	format_indexes.insert(feed_format, formats.size());
 	formats.push_back(feed_format);
+	formats_dirty = true;
+}
+
+void CameraFeedLinux::expire_formats() {
+	// Formats missing from the latest enumeration are kept but marked unavailable, so indexes do not shift.
+	for (int i = 0; i < formats.size(); i++) {
+		FeedFormat &format = formats.write[i];
+		if (format.available && format.generation != format_generation) {
+			format.available = false;
+			formats_dirty = true;
+		}
+	}
+}
+
+int CameraFeedLinux::get_decode_threads(const DecoderSettings &p_settings) {
+	if (p_settings.decode_threads > 0) {
+		return p_settings.decode_threads;
+	}
+	// Leave a core for the engine, more than four workers rarely pays off for a single camera.
+	return CLAMP(int(std::thread::hardware_concurrency()) - 1, 1, 4);
+}
+
+static bool get_packed_layout(uint32_t p_format, PackedBufferDecoder::Layout &r_layout) {
+	switch (p_format) {
+		case SPA_VIDEO_FORMAT_GRAY8:
+			r_layout = PackedBufferDecoder::LAYOUT_GRAY8;
+			return true;
+		case SPA_VIDEO_FORMAT_RGB:
+			r_layout = PackedBufferDecoder::LAYOUT_RGB;
+			return true;
+		case SPA_VIDEO_FORMAT_BGR:
+			r_layout = PackedBufferDecoder::LAYOUT_BGR;
+			return true;
+		case SPA_VIDEO_FORMAT_RGBx:
+			r_layout = PackedBufferDecoder::LAYOUT_RGBX;
+			return true;
+		case SPA_VIDEO_FORMAT_BGRx:
+			r_layout = PackedBufferDecoder::LAYOUT_BGRX;
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Packed color formats only convert to RGB and grayscale ones only to grayscale, copying works for both.
+bool CameraFeedLinux::is_packed_output_supported(PackedBufferDecoder::Layout p_layout, Output p_output) {
+	if (p_output == OUTPUT_COPY) {
+		return true;
+	}
+	return p_output == (p_layout == PackedBufferDecoder::LAYOUT_GRAY8 ? OUTPUT_GRAYSCALE : OUTPUT_RGB);
 }
 
+float CameraFeedLinux::get_decode_cost(const FeedFormat &p_format, Output p_output) const {
+	float cost_per_pixel = 0.0f;
+	float fps = p_format.framerate.denom ? float(p_format.framerate.num) / p_format.framerate.denom : 0.0f;
+	if (p_format.media_subtype == SPA_MEDIA_SUBTYPE_mjpg) {
+		if (p_output != OUTPUT_RGB) {
+			return -1.0f;
+		}
+		// Decoded on several threads, the cost per frame shrinks with their number.
+		float cost = JpegBufferDecoder::COST_PER_PIXEL * p_format.resolution.width * p_format.resolution.height * fps / get_decode_threads(decoder_settings);
+		if (JpegBufferDecoder::SCALED_DECODING) {
+			int denominator = JpegBufferDecoder::get_scale_denominator(p_format.resolution.width, p_format.resolution.height, decoder_settings.target_width, decoder_settings.target_height);
+			cost /= denominator * denominator;
+		}
+		return cost;
+	}
+	if (p_format.media_subtype == SPA_MEDIA_SUBTYPE_bayer) {
+		if (p_output != OUTPUT_RGB) {
+			return -1.0f;
+		}
+		cost_per_pixel = decoder_settings.bayer_binning ? BayerBufferDecoder::BINNING_COST_PER_PIXEL : BayerBufferDecoder::COST_PER_PIXEL;
+		return cost_per_pixel * p_format.resolution.width * p_format.resolution.height * fps;
+	}
+#ifdef FFMPEG_ENABLED
+	if (p_format.media_subtype == SPA_MEDIA_SUBTYPE_h264) {
+		if (p_output != OUTPUT_RGB) {
+			return -1.0f;
+		}
+		return H264BufferDecoder::COST_PER_PIXEL * p_format.resolution.width * p_format.resolution.height * fps / get_decode_threads(decoder_settings);
+	}
+#endif
+	if (p_format.media_subtype != SPA_MEDIA_SUBTYPE_raw) {
+		return -1.0f;
+	}
+	if (p_format.format == SPA_VIDEO_FORMAT_GRAY16_LE) {
+		if (p_output == OUTPUT_RGB) {
+			return -1.0f;
+		}
+		return Gray16BufferDecoder::COST_PER_PIXEL * p_format.resolution.width * p_format.resolution.height * fps;
+	}
+	PackedBufferDecoder::Layout layout;
+	if (get_packed_layout(p_format.format, layout)) {
+		if (!is_packed_output_supported(layout, p_output)) {
+			return -1.0f;
+		}
+		bool direct = layout == PackedBufferDecoder::LAYOUT_GRAY8 || layout == PackedBufferDecoder::LAYOUT_RGB;
+		cost_per_pixel = direct ? PackedBufferDecoder::COST_PER_PIXEL : PackedBufferDecoder::SWIZZLE_COST_PER_PIXEL;
+		return cost_per_pixel * p_format.resolution.width * p_format.resolution.height * fps;
+	}
+	switch (p_output) {
+		case OUTPUT_RGB:
+			cost_per_pixel = YuyvToRgbBufferDecoder::COST_PER_PIXEL;
+			break;
+		case OUTPUT_GRAYSCALE:
+			cost_per_pixel = YuyvToGrayscaleBufferDecoder::COST_PER_PIXEL;
+			break;
+		case OUTPUT_COPY:
+			cost_per_pixel = CopyBufferDecoder::COST_PER_PIXEL;
+			break;
+		default:
+			return -1.0f;
+	}
+	return cost_per_pixel * p_format.resolution.width * p_format.resolution.height * fps;
+}
+
+CameraFeedLinux::Output CameraFeedLinux::get_default_output(const FeedFormat &p_format) const {
+	if (p_format.media_subtype == SPA_MEDIA_SUBTYPE_raw && p_format.format == SPA_VIDEO_FORMAT_GRAY16_LE) {
+		// Keeps the full 16-bit precision, narrowing to 8 bits has to be asked for.
+		return OUTPUT_HALF;
+	}
+	if (get_decode_cost(p_format, OUTPUT_RGB) < 0.0f && get_decode_cost(p_format, OUTPUT_GRAYSCALE) >= 0.0f) {
+		return OUTPUT_GRAYSCALE;
+	}
+	return OUTPUT_RGB;
+}
+
+BufferDecoder *CameraFeedLinux::create_decoder(const FeedFormat &p_format, Output p_output, const DecoderSettings &p_settings) {
+	int *indexes;
+	uint32_t width = p_format.resolution.width;
+	uint32_t height = p_format.resolution.height;
+	if (p_format.media_subtype == SPA_MEDIA_SUBTYPE_mjpg) {
+		if (p_output != OUTPUT_RGB) {
+			return nullptr;
+		}
+		JpegBufferDecoder *jpeg_decoder = memnew(JpegBufferDecoder(this_, get_decode_threads(p_settings)));
+		jpeg_decoder->set_target_size(p_settings.target_width, p_settings.target_height);
+		return jpeg_decoder;
+	}
+	if (p_format.media_subtype == SPA_MEDIA_SUBTYPE_bayer) {
+		if (p_output != OUTPUT_RGB) {
+			return nullptr;
+		}
+		// Patterns are named by the first row of a cell, "rggb" has red at the top left.
+		static const int red_positions[BAYER_PATTERN_MAX][2] = { { 0, 0 }, { 1, 1 }, { 1, 0 }, { 0, 1 } };
+		const int *red = red_positions[p_settings.bayer_pattern];
+		return memnew(BayerBufferDecoder(this_, width, height, red[0], red[1], p_settings.bayer_binning));
+	}
+#ifdef FFMPEG_ENABLED
+	if (p_format.media_subtype == SPA_MEDIA_SUBTYPE_h264) {
+		if (p_output != OUTPUT_RGB) {
+			return nullptr;
+		}
+		H264BufferDecoder *h264_decoder = memnew(H264BufferDecoder(this_, get_decode_threads(p_settings), low_latency));
+		if (!h264_decoder->is_valid()) {
+			memdelete(h264_decoder);
+			return nullptr;
+		}
+		return h264_decoder;
+	}
+#endif
+	if (p_format.media_subtype != SPA_MEDIA_SUBTYPE_raw) {
+		return nullptr;
+	}
+	if (p_format.format == SPA_VIDEO_FORMAT_GRAY16_LE) {
+		switch (p_output) {
+			case OUTPUT_COPY:
+				return memnew(Gray16BufferDecoder(this_, width, height, Gray16BufferDecoder::MODE_PACKED));
+			case OUTPUT_HALF:
+				return memnew(Gray16BufferDecoder(this_, width, height, Gray16BufferDecoder::MODE_HALF, p_settings.range_min, p_settings.range_max));
+			case OUTPUT_FLOAT:
+				return memnew(Gray16BufferDecoder(this_, width, height, Gray16BufferDecoder::MODE_FLOAT, p_settings.range_min, p_settings.range_max));
+			case OUTPUT_GRAYSCALE:
+				return memnew(Gray16BufferDecoder(this_, width, height, Gray16BufferDecoder::MODE_L8, p_settings.range_min, p_settings.range_max));
+			default:
+				return nullptr;
+		}
+	}
+	PackedBufferDecoder::Layout layout;
+	if (get_packed_layout(p_format.format, layout)) {
+		if (!is_packed_output_supported(layout, p_output)) {
+			return nullptr;
+		}
+		return memnew(PackedBufferDecoder(this_, width, height, layout));
+	}
+	if (p_output == OUTPUT_HALF || p_output == OUTPUT_FLOAT) {
+		return nullptr;
+	}
+	switch (p_format.format) {
+		case SPA_VIDEO_FORMAT_YUY2:
+			indexes = new int[4]{ 0, 2, 1, 3 };
+			break;
+		case SPA_VIDEO_FORMAT_YVYU:
+			indexes = new int[4]{ 0, 2, 3, 1 };
+			break;
+		case SPA_VIDEO_FORMAT_UYVY:
+			indexes = new int[4]{ 1, 3, 0, 2 };
+			break;
+		case SPA_VIDEO_FORMAT_VYUY:
+			indexes = new int[4]{ 1, 3, 2, 0 };
+			break;
+		default:
+			return nullptr;
+	}
+	AbstractYuyvBufferDecoder *yuyv_decoder;
+	switch (p_output) {
+		case OUTPUT_GRAYSCALE:
+			yuyv_decoder = memnew(YuyvToGrayscaleBufferDecoder(this_, width, height, indexes));
+			break;
+		case OUTPUT_COPY:
+			delete[] indexes;
+			return memnew(CopyBufferDecoder(this_, width, height, false));
+		default:
+			yuyv_decoder = memnew(YuyvToRgbBufferDecoder(this_, width, height, indexes));
+			break;
+	}
+	yuyv_decoder->set_statistics_enabled(p_settings.frame_statistics);
+	yuyv_decoder->set_motion_threshold(p_settings.motion_threshold);
+	yuyv_decoder->set_pyramid_levels(p_settings.pyramid_levels);
+	return yuyv_decoder;
+}
+
+void CameraFeedLinux::bind_node() {
+	if (proxy) {
+		return;
+	}
+	if (registry) {
+		proxy = (pw_proxy *)pw_registry_bind(registry, id, PW_TYPE_INTERFACE_Node, version, 0);
+	}
+	if (proxy == nullptr) {
+		formats_sync_failed = true;
+		pw_thread_loop_signal(CameraServerLinux::get_loop(), false);
+		return;
+	}
+	node = (pw_node *)proxy;
+	pw_node_add_listener(node, &node_listener, &node_events, this);
+	pw_proxy_add_listener(proxy, &proxy_listener, &proxy_events, this);
+	// Node info arrives before this sync is answered, and re-arms it when formats are enumerated.
+	format_sync_seq = pw_proxy_sync(proxy, 0);
+	formats_sync_failed = false;
+}
+
+bool CameraFeedLinux::wait_for_formats() {
+	pw_thread_loop *loop = CameraServerLinux::get_loop();
+	if (loop == nullptr) {
+		return false;
+	}
+	pw_thread_loop_lock(loop);
+	if (!bind_requested) {
+		// The node is only bound once somebody asks for its formats, unused cameras never get a proxy.
+		bind_requested = true;
+		CameraServerLinux::invoke(do_bind_node, this);
+	}
+	// A failed enumeration is not waited for again until the node re-arms the sync.
+	while (!formats_synced && !formats_sync_failed) {
+		if (pw_thread_loop_timed_wait(loop, 2) != 0) {
+			ERR_PRINT(vformat("Timed out enumerating formats of %s.", name));
+			formats_sync_failed = true;
+		}
+	}
+	bool synced = formats_synced;
+	pw_thread_loop_unlock(loop);
+	return synced;
+}
+
+bool CameraFeedLinux::create_stream() {
+	if (stream) {
+		return true;
+	}
+	if (core == nullptr) {
+		return false;
+	}
+	CharString target = node_name.utf8();
+	struct pw_properties *stream_props = pw_properties_new(
+			PW_KEY_MEDIA_TYPE, "Video",
+			PW_KEY_MEDIA_CATEGORY, "Capture",
+			PW_KEY_MEDIA_ROLE, "Camera",
+			PW_KEY_TARGET_OBJECT, target.get_data(),
+			NULL);
+	stream = pw_stream_new(core, "", stream_props);
+	if (stream == nullptr) {
+		return false;
+	}
+	pw_stream_add_listener(stream, &stream_listener, &stream_events, this);
+	return true;
+}
+
+void CameraFeedLinux::update_buffer_params() {
+	const struct spa_pod *params[3];
+	uint32_t n_params = 0;
+	uint8_t pod_buffer[1024];
+	struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(pod_buffer, sizeof(pod_buffer));
+	if (stream == nullptr) {
+		return;
+	}
+
+	int count = buffer_settings.count;
+	if (count == 0 && low_latency) {
+		// One buffer being filled while the newest one is read.
+		count = 2;
+	}
+	if (count > 0 || buffer_settings.min_size > 0 || buffer_settings.align > 0) {
+		struct spa_pod_frame frame;
+		spa_pod_builder_push_object(&builder, &frame, SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers);
+		if (count > 0) {
+			spa_pod_builder_add(&builder, SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(count, MIN(2, count), count), 0);
+		}
+		if (buffer_settings.min_size > 0) {
+			int size = buffer_settings.min_size;
+			spa_pod_builder_add(&builder, SPA_PARAM_BUFFERS_size, SPA_POD_CHOICE_RANGE_Int(size, size, INT32_MAX), 0);
+		}
+		if (buffer_settings.align > 0) {
+			spa_pod_builder_add(&builder, SPA_PARAM_BUFFERS_align, SPA_POD_Int(buffer_settings.align), 0);
+		}
+		params[n_params++] = (spa_pod *)spa_pod_builder_pop(&builder, &frame);
+	}
+	if (buffer_settings.meta_header) {
+		params[n_params++] = (spa_pod *)spa_pod_builder_add_object(&builder,
+				SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+				SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
+				SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_header)));
+	}
+	if (buffer_settings.meta_damage) {
+		params[n_params++] = (spa_pod *)spa_pod_builder_add_object(&builder,
+				SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+				SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage),
+				SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(sizeof(struct spa_meta_region) * 16, sizeof(struct spa_meta_region), sizeof(struct spa_meta_region) * 16));
+	}
+	if (n_params > 0) {
+		pw_stream_update_params(stream, params, n_params);
+	}
+}
+
+void CameraFeedLinux::update_stream_props() {
+	char latency[32] = "";
+	if (stream == nullptr || selected_format == -1) {
+		return;
+	}
+	if (low_latency) {
+		// Ask the graph to run at the frame interval instead of its default quantum.
+		spa_fraction framerate = get_selected_format().framerate;
+		snprintf(latency, sizeof(latency), "%u/%u", framerate.denom, framerate.num);
+	}
+	const struct spa_dict_item items[] = {
+		SPA_DICT_ITEM_INIT(PW_KEY_NODE_LATENCY, low_latency ? latency : nullptr),
+		SPA_DICT_ITEM_INIT(PW_KEY_NODE_RATE, low_latency ? latency : nullptr),
+	};
+	const struct spa_dict dict = SPA_DICT_INIT_ARRAY(items);
+	pw_stream_update_properties(stream, &dict);
+}
+
+void CameraFeedLinux::record_pending_latency() {
+	uint64_t capture_usec = pending_capture_usec.exchange(0);
+	// Same clock as pw_stream_get_nsec(), which needs a stream that may be gone off the loop thread.
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t now = SPA_TIMESPEC_TO_NSEC(&ts) / 1000;
+	if (capture_usec > 0 && now >= capture_usec) {
+		record_latency(now - capture_usec);
+	}
+}
+
+void CameraFeedLinux::record_latency(uint64_t p_latency_usec) {
+	uint64_t mean = mean_latency_usec;
+	last_latency_usec = p_latency_usec;
+	mean_latency_usec = mean ? (mean * 7 + p_latency_usec) / 8 : p_latency_usec;
+}
+
+Dictionary CameraFeedLinux::get_statistics() const {
+	Dictionary statistics;
+	statistics["low_latency"] = low_latency;
+	statistics["latency_usec"] = last_latency_usec.load();
+	statistics["mean_latency_usec"] = mean_latency_usec.load();
+	return statistics;
+}
+
+CameraFeedLinux::FeedFormat CameraFeedLinux::get_selected_format() const {
+	FeedFormat format = formats[selected_format];
+	if (selected_framerate.denom != 0) {
+		format.framerate = selected_framerate;
+	}
+	return format;
+}
+
+Dictionary CameraFeedLinux::format_to_dictionary(const FeedFormat &p_format) const {
+	Dictionary dictionary;
+	if (p_format.media_subtype == SPA_MEDIA_SUBTYPE_raw) {
+		dictionary["format"] = spa_debug_type_find_short_name(spa_type_video_format, p_format.format);
+	} else {
+		dictionary["format"] = spa_debug_type_find_short_name(spa_type_media_subtype, p_format.media_subtype);
+	}
+	dictionary["width"] = p_format.resolution.width;
+	dictionary["height"] = p_format.resolution.height;
+	dictionary["frame_numerator"] = p_format.framerate.denom;
+	dictionary["frame_denominator"] = p_format.framerate.num;
+	if (p_format.framerate_min.num != p_format.framerate_max.num || p_format.framerate_min.denom != p_format.framerate_max.denom) {
+		dictionary["min_frame_numerator"] = p_format.framerate_max.denom;
+		dictionary["min_frame_denominator"] = p_format.framerate_max.num;
+		dictionary["max_frame_numerator"] = p_format.framerate_min.denom;
+		dictionary["max_frame_denominator"] = p_format.framerate_min.num;
+	}
+	dictionary["available"] = p_format.available;
+	return dictionary;
+}
+
+Dictionary CameraFeedLinux::get_frame_statistics() const {
+	Dictionary statistics;
+	std::shared_lock<std::shared_mutex> decoder_lock(decoder_mutex);
+	if (decoder) {
+		statistics = decoder->get_statistics();
+	}
+	return statistics;
+}
+
+TypedArray<Image> CameraFeedLinux::get_frame_pyramid() const {
+	TypedArray<Image> pyramid;
+	std::shared_lock<std::shared_mutex> decoder_lock(decoder_mutex);
+	if (decoder) {
+		pyramid = decoder->get_pyramid();
+	}
+	return pyramid;
+}
+
+Dictionary CameraFeedLinux::get_summary() const { return summary; }
+
 void CameraFeedLinux::set_this(CameraFeedExtension *feed) {
 	this_ = feed;
 	this_->set_name(name);
@@ -184,113 +979,463 @@ void CameraFeedLinux::set_this(CameraFeedExtension *feed) {
 
 uint32_t CameraFeedLinux::get_object_id() { return id; }
 
+String CameraFeedLinux::get_node_name() const { return node_name; }
+
 bool CameraFeedLinux::activate_feed() {
-	int result = 0;
 	ERR_FAIL_COND_V_MSG(selected_format == -1, false, "CameraFeed format needs to be set before activating.");
 
 	pw_thread_loop *loop = CameraServerLinux::get_loop();
 	if (loop == nullptr) {
 		return false;
 	}
-	if (stream == nullptr) {
-		return false;
+	// Connecting happens on the loop thread, completion is reported by the activated or activation_failed signal.
+	int result = CameraServerLinux::invoke(do_connect_stream, this);
+	return result >= 0;
+}
+
+void CameraFeedLinux::deactivate_feed() {
+	pw_thread_loop *loop = CameraServerLinux::get_loop();
+	if (loop == nullptr) {
+		return;
 	}
+	CameraServerLinux::invoke(do_disconnect_stream, this);
+}
 
-	FeedFormat feed_format = formats[selected_format];
-	uint32_t media_subtype = feed_format.media_subtype;
-	uint32_t format = feed_format.format;
-	spa_rectangle resolution = feed_format.resolution;
-	spa_fraction framerate = feed_format.framerate;
+int CameraFeedLinux::do_connect_stream(struct spa_loop *loop, bool async, uint32_t seq, const void *data, size_t size, void *user_data) {
+	CameraFeedLinux *feed = (CameraFeedLinux *)user_data;
+	feed->connect_stream();
+	return 0;
+}
 
-	int *indexes;
-	if (media_subtype == SPA_MEDIA_SUBTYPE_raw) {
-		switch (format) {
-			case SPA_VIDEO_FORMAT_YUY2:
-				indexes = new int[4]{ 0, 2, 1, 3 };
-				decoder = memnew(YuyvToRgbBufferDecoder(this_, resolution.width, resolution.height, indexes));
-				break;
-			case SPA_VIDEO_FORMAT_YVYU:
-				indexes = new int[4]{ 0, 2, 3, 1 };
-				decoder = memnew(YuyvToRgbBufferDecoder(this_, resolution.width, resolution.height, indexes));
-				break;
-			case SPA_VIDEO_FORMAT_UYVY:
-				indexes = new int[4]{ 1, 3, 0, 2 };
-				decoder = memnew(YuyvToRgbBufferDecoder(this_, resolution.width, resolution.height, indexes));
-				break;
-			case SPA_VIDEO_FORMAT_VYUY:
-				indexes = new int[4]{ 1, 3, 2, 0 };
-				decoder = memnew(YuyvToRgbBufferDecoder(this_, resolution.width, resolution.height, indexes));
-				break;
-			default:
-				return false;
-		}
-	} else {
-		return false;
+int CameraFeedLinux::do_disconnect_stream(struct spa_loop *loop, bool async, uint32_t seq, const void *data, size_t size, void *user_data) {
+	CameraFeedLinux *feed = (CameraFeedLinux *)user_data;
+	feed->disconnect_stream();
+	return 0;
+}
+
+int CameraFeedLinux::do_decode_pending(struct spa_loop *loop, bool async, uint32_t seq, const void *data, size_t size, void *user_data) {
+	CameraFeedLinux *feed = (CameraFeedLinux *)user_data;
+	// Loop thread, decoder is only replaced here. Frames nobody is waiting for stay pending
+	// until request_frame().
+	if (feed->stream && feed->decoder && feed->has_consumers() && feed->decoder->decode_pending()) {
+		feed->record_pending_latency();
 	}
+	return 0;
+}
 
-	pw_thread_loop_lock(loop);
+int CameraFeedLinux::do_bind_node(struct spa_loop *loop, bool async, uint32_t seq, const void *data, size_t size, void *user_data) {
+	CameraFeedLinux *feed = (CameraFeedLinux *)user_data;
+	feed->bind_node();
+	return 0;
+}
+
+int CameraFeedLinux::do_destroy(struct spa_loop *loop, bool async, uint32_t seq, const void *data, size_t size, void *user_data) {
+	CameraFeedLinux *feed = (CameraFeedLinux *)user_data;
+	if (feed->activation_timer) {
+		pw_loop_destroy_source(pw_thread_loop_get_loop(CameraServerLinux::get_loop()), feed->activation_timer);
+	}
+	if (feed->stream) {
+		pw_stream_destroy(feed->stream);
+	}
+	if (feed->proxy) {
+		pw_proxy_destroy(feed->proxy);
+	}
+	feed->destroyed = true;
+	pw_thread_loop_signal(CameraServerLinux::get_loop(), false);
+	return 0;
+}
+
+bool CameraFeedLinux::is_activation_async() const { return true; }
+
+void CameraFeedLinux::connect_stream() {
+	int result = 0;
+	if (!create_stream()) {
+		emit_activation_failed("Failed to create stream.");
+		return;
+	}
+
+	FeedFormat feed_format = get_selected_format();
+	BufferDecoder *next_decoder = create_decoder(feed_format, selected_output, decoder_settings);
+	{
+		std::lock_guard<std::shared_mutex> decoder_lock(decoder_mutex);
+		decoder = next_decoder;
+		decoder_format = feed_format;
+	}
+	if (decoder == nullptr) {
+		emit_activation_failed("Unsupported format.");
+		return;
+	}
+
+	last_latency_usec = 0;
+	mean_latency_usec = 0;
+	pending_capture_usec = 0;
+	reserved_size = 0;
+	update_stream_props();
+	activation_pending = true;
+	format_negotiated = false;
+	pw_loop *loop = pw_thread_loop_get_loop(CameraServerLinux::get_loop());
+	if (activation_timer == nullptr) {
+		activation_timer = pw_loop_add_timer(loop, on_activation_timeout, this);
+	}
+	if (activation_timer) {
+		struct timespec timeout = { ACTIVATION_TIMEOUT_SEC, 0 };
+		pw_loop_update_timer(loop, activation_timer, &timeout, nullptr, false);
+	}
 	while (true) {
 		pw_stream_flags stream_flags = pw_stream_flags(PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS);
+		// Inter-coded frames may not be dropped when the decoder is busy, so they stay off the realtime thread.
+		rt_process = low_latency && lazy_decoding && feed_format.media_subtype != SPA_MEDIA_SUBTYPE_h264;
+		if (rt_process) {
+			// process() only copies the frame then, see on_stream_process().
+			stream_flags = pw_stream_flags(stream_flags | PW_STREAM_FLAG_RT_PROCESS);
+		}
 		result = pw_stream_connect(stream, PW_DIRECTION_INPUT, PW_ID_ANY, stream_flags, nullptr, 0);
 		if (result < 0) {
 			break;
 		}
-		const struct spa_pod *param[1];
-		uint8_t buffer[1024];
-		struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
-		param[0] = (spa_pod *)spa_pod_builder_add_object(&builder,
-				SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
-				SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
-				SPA_FORMAT_mediaSubtype, SPA_POD_Id(media_subtype),
-				SPA_FORMAT_VIDEO_format, SPA_POD_Id(format),
-				SPA_FORMAT_VIDEO_size, SPA_POD_Rectangle(&resolution),
-				SPA_FORMAT_VIDEO_framerate, SPA_POD_Fraction(&framerate));
-		result = pw_stream_update_params(stream, param, 1);
+		result = update_format_params(feed_format);
 		break;
 	}
+	if (result < 0) {
+		activation_pending = false;
+		pw_stream_disconnect(stream);
+		std::lock_guard<std::shared_mutex> decoder_lock(decoder_mutex);
+		memdelete(decoder);
+		decoder = nullptr;
+		emit_activation_failed(spa_strerror(result));
+	}
+}
+
+int CameraFeedLinux::update_format_params(const FeedFormat &p_format) {
+	spa_rectangle resolution = p_format.resolution;
+	spa_fraction framerate = p_format.framerate;
+	const struct spa_pod *param[1];
+	uint8_t buffer[1024];
+	struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+	struct spa_pod_frame frame;
+	spa_pod_builder_push_object(&builder, &frame, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
+	spa_pod_builder_add(&builder,
+			SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
+			SPA_FORMAT_mediaSubtype, SPA_POD_Id(p_format.media_subtype), 0);
+	// Compressed formats have no pixel format.
+	if (p_format.media_subtype == SPA_MEDIA_SUBTYPE_raw) {
+		spa_pod_builder_add(&builder, SPA_FORMAT_VIDEO_format, SPA_POD_Id(p_format.format), 0);
+	} else if (p_format.media_subtype == SPA_MEDIA_SUBTYPE_h264) {
+		// Whole access units in Annex B byte stream form, as libavcodec expects them.
+		spa_pod_builder_add(&builder,
+				SPA_FORMAT_VIDEO_H264_streamFormat, SPA_POD_Id(SPA_H264_STREAM_FORMAT_BYTESTREAM),
+				SPA_FORMAT_VIDEO_H264_alignment, SPA_POD_Id(SPA_H264_ALIGNMENT_AU), 0);
+	}
+	spa_pod_builder_add(&builder,
+			SPA_FORMAT_VIDEO_size, SPA_POD_Rectangle(&resolution),
+			SPA_FORMAT_VIDEO_framerate, SPA_POD_Fraction(&framerate), 0);
+	param[0] = (spa_pod *)spa_pod_builder_pop(&builder, &frame);
+	return pw_stream_update_params(stream, param, 1);
+}
+
+void CameraFeedLinux::disconnect_stream() {
+	activation_pending = false;
+	if (stream) {
+		pw_stream_disconnect(stream);
+	}
+	{
+		std::lock_guard<std::shared_mutex> decoder_lock(decoder_mutex);
+		if (decoder) {
+			memdelete(decoder);
+			decoder = nullptr;
+		}
+	}
+	if (pending_decoder) {
+		memdelete(pending_decoder);
+		pending_decoder = nullptr;
+	}
+	paused = false;
+}
+
+bool CameraFeedLinux::switch_format(int p_index, Output p_output, const BufferSettings &p_settings, const DecoderSettings &p_decoder_settings) {
+	pw_thread_loop *loop = CameraServerLinux::get_loop();
+	if (loop == nullptr) {
+		return false;
+	}
+	// The decoder for the new format is ready before renegotiation, the current one keeps
+	// presenting frames until param_changed swaps them.
+	BufferDecoder *next_decoder = create_decoder(formats[p_index], p_output, p_decoder_settings);
+	ERR_FAIL_NULL_V_MSG(next_decoder, false, "Unsupported format.");
+
+	pw_thread_loop_lock(loop);
+	if (rt_process && formats[p_index].media_subtype == SPA_MEDIA_SUBTYPE_h264) {
+		pw_thread_loop_unlock(loop);
+		memdelete(next_decoder);
+		ERR_FAIL_V_MSG(false, "H.264 cannot be decoded from the realtime thread, reactivate the feed without low_latency or lazy_decoding.");
+	}
+	bool same_format = stream && p_index == selected_format;
+	if (same_format) {
+		// The stream format stays, so there is no renegotiation to install the decoder.
+		if (pending_decoder) {
+			// A switch to this format is still being negotiated, param_changed installs this one.
+			memdelete(pending_decoder);
+			pending_decoder = next_decoder;
+		} else {
+			std::lock_guard<std::shared_mutex> decoder_lock(decoder_mutex);
+			if (decoder) {
+				memdelete(decoder);
+			}
+			decoder = next_decoder;
+			if (reserved_size > 0) {
+				decoder->reserve_pending(reserved_size);
+			}
+			this_->call_deferred("emit_signal", "format_changed");
+		}
+	} else {
+		int result = -1;
+		if (stream) {
+			result = update_format_params(formats[p_index]);
+		}
+		if (result < 0) {
+			pw_thread_loop_unlock(loop);
+			memdelete(next_decoder);
+			ERR_FAIL_V_MSG(false, "Failed to renegotiate the stream format.");
+		}
+		if (pending_decoder) {
+			memdelete(pending_decoder);
+		}
+		pending_decoder = next_decoder;
+		pending_format = formats[p_index];
+		selected_format = p_index;
+		selected_framerate = {};
+	}
+	selected_output = p_output;
+	buffer_settings = p_settings;
+	decoder_settings = p_decoder_settings;
+	if (same_format) {
+		// Otherwise param_changed applies the buffer settings to the new format.
+		update_buffer_params();
+	}
+	update_stream_props();
 	pw_thread_loop_unlock(loop);
-	return result == 0;
+	return true;
 }
 
-void CameraFeedLinux::deactivate_feed() {
+bool CameraFeedLinux::set_paused(bool p_paused) {
+	ERR_FAIL_COND_V_MSG(!this_->is_active(), false, "Feed is not active.");
 	pw_thread_loop *loop = CameraServerLinux::get_loop();
 	if (loop == nullptr) {
-		return;
+		return false;
 	}
 	pw_thread_loop_lock(loop);
+	int result = -1;
 	if (stream) {
-		pw_stream_disconnect(stream);
+		// Format, buffers and decoder stay in place, resuming only restarts the graph.
+		result = pw_stream_set_active(stream, !p_paused);
+	}
+	if (result == 0) {
+		paused = p_paused;
 	}
-	memdelete(decoder);
 	pw_thread_loop_unlock(loop);
+	return result == 0;
 }
 
-TypedArray<Dictionary> CameraFeedLinux::get_formats() const {
-	TypedArray<Dictionary> result;
-	for (const FeedFormat &format : formats) {
-		Dictionary dictionary;
-		if (format.media_subtype == SPA_MEDIA_SUBTYPE_raw) {
-			dictionary["format"] = spa_debug_type_find_short_name(spa_type_video_format, format.format);
-		} else {
-			dictionary["format"] = spa_debug_type_find_short_name(spa_type_media_subtype, format.media_subtype);
-		}
-		dictionary["width"] = format.resolution.width;
-		dictionary["height"] = format.resolution.height;
-		dictionary["frame_numerator"] = format.framerate.denom;
-		dictionary["frame_denominator"] = format.framerate.num;
-		result.push_back(dictionary);
+bool CameraFeedLinux::requires_every_frame() const {
+	pw_thread_loop *loop = CameraServerLinux::get_loop();
+	if (loop == nullptr) {
+		return false;
 	}
+	pw_thread_loop_lock(loop);
+	bool result = selected_format != -1 && formats[selected_format].media_subtype == SPA_MEDIA_SUBTYPE_h264;
+	pw_thread_loop_unlock(loop);
 	return result;
 }
 
+Ref<Image> CameraFeedLinux::decode_frame(StreamingBuffer p_buffer) {
+	std::shared_lock<std::shared_mutex> decoder_lock(decoder_mutex);
+	if (decoder == nullptr) {
+		return Ref<Image>();
+	}
+	return decoder->decode_image(p_buffer);
+}
+
+bool CameraFeedLinux::decode_pending() {
+	// The decoder takes the pending frame under its own lock, the loop keeps dequeuing meanwhile.
+	std::shared_lock<std::shared_mutex> decoder_lock(decoder_mutex);
+	if (decoder == nullptr || !decoder->decode_pending()) {
+		return false;
+	}
+	record_pending_latency();
+	return true;
+}
+
+TypedArray<Dictionary> CameraFeedLinux::get_formats() {
+	pw_thread_loop *loop = CameraServerLinux::get_loop();
+	if (loop == nullptr) {
+		return formats_snapshot;
+	}
+	wait_for_formats();
+	pw_thread_loop_lock(loop);
+	if (formats_dirty) {
+		TypedArray<Dictionary> result;
+		for (const FeedFormat &format : formats) {
+			result.push_back(format_to_dictionary(format));
+		}
+		formats_snapshot = result;
+		formats_dirty = false;
+	}
+	pw_thread_loop_unlock(loop);
+	return formats_snapshot;
+}
+
 bool CameraFeedLinux::set_format(int p_index, const Dictionary &p_parameters) {
-	ERR_FAIL_COND_V_MSG(this_->is_active(), false, "Feed is active.");
-	ERR_FAIL_INDEX_V_MSG(p_index, formats.size(), false, "Invalid format index.");
+	pw_thread_loop *loop = CameraServerLinux::get_loop();
+	if (loop == nullptr) {
+		return false;
+	}
+	wait_for_formats();
+	// Formats are added on the loop thread, the requested one is copied out under its lock.
+	pw_thread_loop_lock(loop);
+	bool valid_index = p_index >= 0 && p_index < formats.size();
+	FeedFormat format = {};
+	if (valid_index) {
+		format = formats[p_index];
+	}
+	pw_thread_loop_unlock(loop);
+	ERR_FAIL_COND_V_MSG(!valid_index, false, "Invalid format index.");
+	ERR_FAIL_COND_V_MSG(!format.available, false, "Format is no longer offered by the node.");
+
+	Output output = get_default_output(format);
+	if (p_parameters.has("output")) {
+		String name = p_parameters["output"];
+		for (int i = 0; i < OUTPUT_MAX; i++) {
+			if (name == output_names[i]) {
+				output = Output(i);
+				break;
+			}
+		}
+		ERR_FAIL_COND_V_MSG(name != output_names[output], false, vformat("Invalid output \"%s\".", name));
+	}
+	ERR_FAIL_COND_V_MSG(get_decode_cost(format, output) < 0.0f, false, vformat("Output \"%s\" is not supported by this format.", output_names[output]));
+
+	BayerPattern pattern = BAYER_PATTERN_RGGB;
+	if (p_parameters.has("bayer_pattern")) {
+		String name = p_parameters["bayer_pattern"];
+		for (int i = 0; i < BAYER_PATTERN_MAX; i++) {
+			if (name == bayer_pattern_names[i]) {
+				pattern = BayerPattern(i);
+				break;
+			}
+		}
+		ERR_FAIL_COND_V_MSG(name != bayer_pattern_names[pattern], false, vformat("Invalid Bayer pattern \"%s\".", name));
+	}
 
+	BufferSettings settings;
+	settings.count = p_parameters.get("buffer_count", 0);
+	settings.min_size = p_parameters.get("buffer_min_size", 0);
+	settings.align = p_parameters.get("buffer_align", 0);
+	settings.meta_header = p_parameters.get("meta_header", true);
+	settings.meta_damage = p_parameters.get("meta_damage", false);
+	ERR_FAIL_COND_V_MSG(settings.count < 0 || settings.min_size < 0 || settings.align < 0, false, "Buffer settings must not be negative.");
+
+	DecoderSettings next_settings;
+	next_settings.frame_statistics = p_parameters.get("statistics", false);
+	next_settings.motion_threshold = p_parameters.get("motion_threshold", 0);
+	next_settings.pyramid_levels = p_parameters.get("pyramid_levels", 0);
+	next_settings.decode_threads = p_parameters.get("decode_threads", 0);
+	next_settings.target_width = p_parameters.get("target_width", 0);
+	next_settings.target_height = p_parameters.get("target_height", 0);
+	next_settings.bayer_pattern = pattern;
+	next_settings.bayer_binning = p_parameters.get("bayer_binning", false);
+	next_settings.range_min = p_parameters.get("range_min", 0);
+	next_settings.range_max = p_parameters.get("range_max", 65535);
+	bool next_low_latency = p_parameters.get("low_latency", false);
+	if (this_->is_active()) {
+		// Stream flags and decoder threading are fixed when the stream connects.
+		ERR_FAIL_COND_V_MSG(next_low_latency != low_latency, false, "low_latency can only be changed while the feed is inactive.");
+		return switch_format(p_index, output, settings, next_settings);
+	}
+	pw_thread_loop_lock(loop);
 	selected_format = p_index;
+	selected_framerate = {};
+	selected_output = output;
+	buffer_settings = settings;
+	decoder_settings = next_settings;
+	low_latency = next_low_latency;
+	pw_thread_loop_unlock(loop);
 	return true;
 }
 
+int CameraFeedLinux::select_format(const Dictionary &p_constraints) {
+	int best_format = -1;
+	Output best_output = OUTPUT_RGB;
+	spa_fraction best_framerate = {};
+	float best_cost = 0.0f;
+	int min_width = p_constraints.get("min_width", 0);
+	int min_height = p_constraints.get("min_height", 0);
+	int max_width = p_constraints.get("max_width", INT32_MAX);
+	int max_height = p_constraints.get("max_height", INT32_MAX);
+	float min_fps = p_constraints.get("min_fps", 0.0f);
+	// Copying is only wanted when asked for, it leaves the raw bytes to the caller.
+	Array outputs = p_constraints.get("outputs", Array());
+	if (outputs.is_empty()) {
+		outputs.push_back(output_names[OUTPUT_RGB]);
+		outputs.push_back(output_names[OUTPUT_GRAYSCALE]);
+	}
+	ERR_FAIL_COND_V_MSG(this_->is_active(), -1, "Feed is active.");
+
+	pw_thread_loop *loop = CameraServerLinux::get_loop();
+	if (loop == nullptr) {
+		return -1;
+	}
+	wait_for_formats();
+	pw_thread_loop_lock(loop);
+	for (int i = 0; i < formats.size(); i++) {
+		const FeedFormat &format = formats[i];
+		if (!format.available) {
+			continue;
+		}
+		int width = format.resolution.width;
+		int height = format.resolution.height;
+		if (width < min_width || height < min_height || width > max_width || height > max_height) {
+			continue;
+		}
+		if (format.framerate_max.denom == 0 || float(format.framerate_max.num) / format.framerate_max.denom < min_fps) {
+			continue;
+		}
+		// A range whose default is too slow runs at its fastest rate, which is also what it costs.
+		FeedFormat candidate = format;
+		if (format.framerate.denom == 0 || float(format.framerate.num) / format.framerate.denom < min_fps) {
+			candidate.framerate = format.framerate_max;
+		}
+		for (int j = 0; j < OUTPUT_MAX; j++) {
+			if (!outputs.has(output_names[j])) {
+				continue;
+			}
+			float cost = get_decode_cost(candidate, Output(j));
+			if (cost < 0.0f) {
+				continue;
+			}
+			if (best_format != -1) {
+				// Prefer the larger resolution when two candidates cost the same.
+				const FeedFormat &best = formats[best_format];
+				if (cost > best_cost) {
+					continue;
+				}
+				if (cost == best_cost && width * height <= int(best.resolution.width * best.resolution.height)) {
+					continue;
+				}
+			}
+			best_format = i;
+			best_output = Output(j);
+			best_framerate = candidate.framerate;
+			best_cost = cost;
+		}
+	}
+	if (best_format != -1) {
+		selected_format = best_format;
+		selected_output = best_output;
+		selected_framerate = best_framerate;
+	}
+	pw_thread_loop_unlock(loop);
+	return best_format;
+}
+
 CameraFeedExtension::CameraFeedExtension() {
 	impl = std::make_unique<CameraFeedLinux>(this);
 }
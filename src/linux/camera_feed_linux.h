@@ -5,57 +5,236 @@
 
 #include <pipewire/pipewire.h>
 
+#include <shared_mutex>
+
+#include "godot_cpp/templates/hash_map.hpp"
+
 #include "buffer_decoder.h"
 
 static void on_node_info(void *data, const struct pw_node_info *info);
 static void on_node_param(void *data, int seq, uint32_t id, uint32_t index, uint32_t next, const struct spa_pod *param);
 static void on_proxy_destroy(void *data);
+static void on_proxy_done(void *data, int seq);
 static void on_stream_destroy(void *data);
+static void on_stream_state_changed(void *data, enum pw_stream_state old, enum pw_stream_state state, const char *error);
+static void on_stream_param_changed(void *data, uint32_t id, const struct spa_pod *param);
+static void on_activation_timeout(void *data, uint64_t expirations);
+static void on_stream_add_buffer(void *data, struct pw_buffer *buffer);
+static void on_stream_remove_buffer(void *data, struct pw_buffer *buffer);
 static void on_stream_process(void *data);
 
 class CameraFeedLinux : public extension::CameraFeed {
 private:
+	enum Output {
+		OUTPUT_RGB,
+		OUTPUT_GRAYSCALE,
+		OUTPUT_COPY,
+		OUTPUT_HALF,
+		OUTPUT_FLOAT,
+		OUTPUT_MAX,
+	};
+
+	enum BayerPattern {
+		BAYER_PATTERN_RGGB,
+		BAYER_PATTERN_BGGR,
+		BAYER_PATTERN_GRBG,
+		BAYER_PATTERN_GBRG,
+		BAYER_PATTERN_MAX,
+	};
+
 	struct FeedFormat {
 		uint32_t media_subtype;
 		uint32_t format;
 		spa_rectangle resolution;
+		// Default framerate, min and max are equal unless the node offers a range.
 		spa_fraction framerate;
+		spa_fraction framerate_min;
+		spa_fraction framerate_max;
+		uint32_t generation = 0;
+		bool available = true;
+
+		// Same buffer layout, a decoder built for one format can decode the other.
+		bool is_layout_equal(const FeedFormat &p_other) const;
+		bool operator==(const FeedFormat &p_other) const;
+	};
+
+	// Zero leaves the value to PipeWire.
+	struct BufferSettings {
+		int count = 0;
+		int min_size = 0;
+		int align = 0;
+		bool meta_header = true;
+		bool meta_damage = false;
+	};
+
+	// Applies to decoders created from then on.
+	struct DecoderSettings {
+		bool frame_statistics = false;
+		int motion_threshold = 0;
+		int pyramid_levels = 0;
+		// Zero picks a count from the available cores.
+		int decode_threads = 0;
+		// Smallest output size wanted from compressed formats, zero keeps the full size.
+		int target_width = 0;
+		int target_height = 0;
+		BayerPattern bayer_pattern = BAYER_PATTERN_RGGB;
+		bool bayer_binning = false;
+		// Range of 16-bit luminance mapped to 0-1 or 0-255.
+		int range_min = 0;
+		int range_max = 65535;
+	};
+
+	// One per pw_buffer, the buffer is requeued when the last reader releases it. Requeueing is
+	// handed to the loop thread, so releasing never waits for the loop lock.
+	class Lease : public BufferLease {
+	protected:
+		void release() override;
+
+	public:
+		CameraFeedLinux *feed = nullptr;
+		// Cleared once PipeWire removed the buffer, its memory is gone from then on.
+		pw_buffer *buffer = nullptr;
+		// Loop thread only. Dequeued and not yet released, and removed while still held, in which
+		// case the last release frees the lease.
+		bool in_use = false;
+		bool orphaned = false;
+
+		Lease(CameraFeedLinux *p_feed, pw_buffer *p_buffer);
+
+		static int do_release(struct spa_loop *loop, bool async, uint32_t seq, const void *data, size_t size, void *user_data);
+	};
+
+	struct FeedFormatHasher {
+		static uint32_t hash(const FeedFormat &p_format);
 	};
 
 	uint32_t id = -1;
-	const char *name = "";
+	uint32_t version = 0;
+	String name;
+	String node_name;
+	Dictionary summary;
+	pw_core *core = nullptr;
+	pw_registry *registry = nullptr;
 	pw_proxy *proxy = nullptr;
 	pw_node *node = nullptr;
 	pw_stream *stream = nullptr;
 	spa_hook node_listener = {};
 	spa_hook proxy_listener = {};
 	spa_hook stream_listener = {};
+	// Formats are only appended, so an index stays valid for the lifetime of the feed.
 	Vector<FeedFormat> formats;
+	HashMap<FeedFormat, int, FeedFormatHasher> format_indexes;
+	HashMap<uint32_t, uint32_t> param_flags;
+	uint32_t format_generation = 0;
+	int format_sync_seq = -1;
+	bool formats_synced = false;
+	// Set when enumeration timed out or the node went away, cleared once a new sync is armed.
+	bool formats_sync_failed = false;
+	// Set by the first wait_for_formats(), which binds the node on the loop thread.
+	bool bind_requested = false;
+	TypedArray<Dictionary> formats_snapshot;
+	bool formats_dirty = true;
+	Output selected_output = OUTPUT_RGB;
+	// Picked by select_format() within a framerate range, zero keeps the format's default.
+	spa_fraction selected_framerate = {};
+	BufferSettings buffer_settings;
+	bool low_latency = false;
+	bool rt_process = false;
+	DecoderSettings decoder_settings;
+	std::atomic<uint64_t> last_latency_usec = 0;
+	std::atomic<uint64_t> mean_latency_usec = 0;
+	// Capture time of the frame left for decode_pending(), zero without a presentation timestamp.
+	std::atomic<uint64_t> pending_capture_usec = 0;
+	// Largest buffer negotiated, the realtime thread copies frames into slots reserved this large.
+	size_t reserved_size = 0;
 	BufferDecoder *decoder = nullptr;
+	// Held exclusively while decoder is replaced, shared by readers outside the loop thread so a
+	// decode never holds the loop lock.
+	mutable std::shared_mutex decoder_mutex;
+	// The format decoder was built for, the negotiated one once the stream has a format.
+	FeedFormat decoder_format = {};
+	// Replaces decoder once a live format switch has been negotiated.
+	BufferDecoder *pending_decoder = nullptr;
+	FeedFormat pending_format = {};
 	StreamingBuffer *buffer = nullptr;
+	// Set by connect_stream() until the stream starts streaming or fails, loop thread only.
+	bool activation_pending = false;
+	// Fails an activation still pending after ACTIVATION_TIMEOUT_SEC, loop thread only.
+	spa_source *activation_timer = nullptr;
+	// Set by do_destroy(), the destructor waits for it under the loop lock.
+	bool destroyed = false;
+	// What param_changed reported last, activated carries it rather than the requested format.
+	FeedFormat negotiated_format = {};
+	bool format_negotiated = false;
 
+	static constexpr int ACTIVATION_TIMEOUT_SEC = 5;
+	static const char *output_names[OUTPUT_MAX];
+	static const char *bayer_pattern_names[BAYER_PATTERN_MAX];
 
-	void add_format(const uint32_t media_subtype, const uint32_t format, const spa_rectangle resolution, const spa_fraction framerate);
+	void add_format(const uint32_t media_subtype, const uint32_t format, const spa_rectangle resolution, const spa_fraction framerate, const spa_fraction framerate_min, const spa_fraction framerate_max);
+	void expire_formats();
+	void bind_node();
+	bool wait_for_formats();
+	bool create_stream();
+	void update_buffer_params();
+	int update_format_params(const FeedFormat &p_format);
+	bool switch_format(int p_index, Output p_output, const BufferSettings &p_settings, const DecoderSettings &p_decoder_settings);
+	void connect_stream();
+	void disconnect_stream();
+	Dictionary format_to_dictionary(const FeedFormat &p_format) const;
+	FeedFormat get_selected_format() const;
+	void update_stream_props();
+	void record_latency(uint64_t p_latency_usec);
+	void record_pending_latency();
+	static int get_decode_threads(const DecoderSettings &p_settings);
+	float get_decode_cost(const FeedFormat &p_format, Output p_output) const;
+	Output get_default_output(const FeedFormat &p_format) const;
+	BufferDecoder *create_decoder(const FeedFormat &p_format, Output p_output, const DecoderSettings &p_settings);
+	static bool is_packed_output_supported(PackedBufferDecoder::Layout p_layout, Output p_output);
 
 	void set_this(CameraFeedExtension *feed) override;
+	bool decode_pending() override;
+	bool is_activation_async() const override;
+
+	static int do_connect_stream(struct spa_loop *loop, bool async, uint32_t seq, const void *data, size_t size, void *user_data);
+	static int do_disconnect_stream(struct spa_loop *loop, bool async, uint32_t seq, const void *data, size_t size, void *user_data);
+	static int do_destroy(struct spa_loop *loop, bool async, uint32_t seq, const void *data, size_t size, void *user_data);
+	static int do_bind_node(struct spa_loop *loop, bool async, uint32_t seq, const void *data, size_t size, void *user_data);
+	static int do_decode_pending(struct spa_loop *loop, bool async, uint32_t seq, const void *data, size_t size, void *user_data);
 
 public:
 	CameraFeedLinux(CameraFeedExtension *feed);
-	CameraFeedLinux(uint32_t id, const char *name, pw_proxy *proxy, pw_stream *stream);
+	CameraFeedLinux(uint32_t id, uint32_t version, const spa_dict *props, pw_core *core, pw_registry *registry);
 	~CameraFeedLinux();
 
 	uint32_t get_object_id();
+	String get_node_name() const;
+	Dictionary get_summary() const override;
 
 	bool activate_feed() override;
 	void deactivate_feed() override;
+	bool set_paused(bool p_paused) override;
+	bool requires_every_frame() const override;
 
-	TypedArray<Dictionary> get_formats() const override;
+	TypedArray<Dictionary> get_formats() override;
 	bool set_format(int p_index, const Dictionary &p_parameters) override;
+	int select_format(const Dictionary &p_constraints) override;
+
+	Ref<Image> decode_frame(StreamingBuffer p_buffer) override;
+	Dictionary get_statistics() const override;
+	Dictionary get_frame_statistics() const override;
+	TypedArray<Image> get_frame_pyramid() const override;
 
 	friend void on_node_info(void *data, const struct pw_node_info *info);
 	friend void on_node_param(void *data, int seq, uint32_t id, uint32_t index, uint32_t next, const struct spa_pod *param);
 	friend void on_proxy_destroy(void *data);
+	friend void on_proxy_done(void *data, int seq);
 	friend void on_stream_destroy(void *data);
+	friend void on_stream_state_changed(void *data, enum pw_stream_state old, enum pw_stream_state state, const char *error);
+	friend void on_stream_param_changed(void *data, uint32_t id, const struct spa_pod *param);
+	friend void on_activation_timeout(void *data, uint64_t expirations);
+	friend void on_stream_add_buffer(void *data, struct pw_buffer *buffer);
+	friend void on_stream_remove_buffer(void *data, struct pw_buffer *buffer);
 	friend void on_stream_process(void *data);
 };
 
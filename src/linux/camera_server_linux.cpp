@@ -1,14 +1,18 @@
 #include "camera_server_linux.h"
 
+#include <cerrno>
 #include <fcntl.h>
 #include <memory>
 
 #include <spa/utils/keys.h>
 
+#include "godot_cpp/classes/time.hpp"
+
 #include "camera_feed_linux.h"
 #include "portal.h"
 
 pw_thread_loop *CameraServerLinux::loop = nullptr;
+std::mutex CameraServerLinux::invoke_mutex;
 
 static void on_permission_callback(GDBusConnection *connection, const char *sender_name, const char *object_path, const char *interface_name, const char *signal_name, GVariant *parameters, void *user_data) {
 	CameraServerLinux *server = (CameraServerLinux *)(user_data);
@@ -35,47 +39,36 @@ static void on_registry_event_global(void *user_data, uint32_t id, uint32_t perm
 	if (strcmp(media_class, "Video/Source") && strcmp(media_role, "Camera")) {
 		return;
 	}
-	TypedArray<CameraFeed> feeds = server->this_->get_server()->feeds();
-	for (int i = 0; i < feeds.size(); i++) {
-		Ref<CameraFeedExtension> feed = feeds[i];
-		if (feed.is_null()) {
-			continue;
-		}
-		CameraFeedLinux *impl = (CameraFeedLinux *)feed->get_impl();
-		if (impl->get_object_id() == id) {
-			return;
-		}
-	}
-	struct pw_properties *feed_props = pw_properties_new_dict(props);
-	struct pw_properties *stream_props = pw_properties_new(
-			PW_KEY_MEDIA_TYPE, "Video",
-			PW_KEY_MEDIA_CATEGORY, "Capture",
-			PW_KEY_MEDIA_ROLE, "Camera",
-			PW_KEY_TARGET_OBJECT, pw_properties_get(feed_props, PW_KEY_NODE_NAME),
-			NULL);
-	pw_stream *stream = pw_stream_new(server->core, "", stream_props);
-	struct pw_proxy *feed_proxy = (struct pw_proxy *)pw_registry_bind(server->registry, id, type, version, 0);
-	const char *feed_name = pw_properties_get(feed_props, PW_KEY_NODE_DESCRIPTION);
-	std::unique_ptr<CameraFeedLinux> feed_impl = std::make_unique<CameraFeedLinux>(id, feed_name, feed_proxy, stream);
-	Ref<CameraFeedExtension> feed = memnew(CameraFeedExtension(std::move(feed_impl)));
-	server->this_->get_server()->add_feed(feed);
-	pw_properties_free(feed_props);
+	server->camera_nodes.insert(id);
+	CameraServerLinux::HotplugEvent *event = new CameraServerLinux::HotplugEvent();
+	event->type = CameraServerLinux::HotplugEvent::GLOBAL;
+	event->id = id;
+	event->version = version;
+	event->props = pw_properties_new_dict(props);
+	server->push_hotplug_event(event);
 }
 
 static void on_registry_event_global_remove(void *user_data, uint32_t id) {
 	CameraServerLinux *server = (CameraServerLinux *)user_data;
-	TypedArray<CameraFeed> feeds = server->this_->get_server()->feeds();
-	for (int i = 0; i < feeds.size(); i++) {
-		Ref<CameraFeedExtension> feed = feeds[i];
-		if (feed.is_null()) {
-			continue;
-		}
-		CameraFeedLinux *impl = (CameraFeedLinux *)feed->get_impl();
-		if (impl->get_object_id() == id) {
-			server->this_->get_server()->remove_feed(feed);
-			break;
-		}
+	// Most globals are not cameras, only removals of announced ones are queued.
+	if (!server->camera_nodes.erase(id)) {
+		return;
 	}
+	CameraServerLinux::HotplugEvent *event = new CameraServerLinux::HotplugEvent();
+	event->type = CameraServerLinux::HotplugEvent::GLOBAL_REMOVE;
+	event->id = id;
+	server->push_hotplug_event(event);
+}
+
+static void on_core_done(void *user_data, uint32_t id, int seq) {
+	CameraServerLinux *server = (CameraServerLinux *)user_data;
+	if (id != PW_ID_CORE || seq != server->registry_sync_seq) {
+		return;
+	}
+	server->set_startup_timing("registry_sync", server->registry_sync_start);
+	CameraServerLinux::HotplugEvent *event = new CameraServerLinux::HotplugEvent();
+	event->type = CameraServerLinux::HotplugEvent::SYNC_DONE;
+	server->push_hotplug_event(event);
 }
 
 static const struct pw_registry_events registry_events = {
@@ -84,31 +77,59 @@ static const struct pw_registry_events registry_events = {
 	.global_remove = on_registry_event_global_remove,
 };
 
+static const struct pw_core_events core_events = {
+	.version = PW_VERSION_CORE_EVENTS,
+	.done = on_core_done,
+};
+
 pw_thread_loop *CameraServerLinux::get_loop() {
 	return loop;
 }
 
+int CameraServerLinux::invoke(spa_invoke_func_t p_func, void *p_user_data) {
+	if (loop == nullptr) {
+		return -EINVAL;
+	}
+	if (pw_thread_loop_in_thread(loop)) {
+		return pw_loop_invoke(pw_thread_loop_get_loop(loop), p_func, 0, nullptr, 0, false, p_user_data);
+	}
+	std::lock_guard<std::mutex> lock(invoke_mutex);
+	return pw_loop_invoke(pw_thread_loop_get_loop(loop), p_func, 0, nullptr, 0, false, p_user_data);
+}
+
+bool CameraServerLinux::try_invoke(spa_invoke_func_t p_func, void *p_user_data) {
+	if (loop == nullptr) {
+		return false;
+	}
+	std::unique_lock<std::mutex> lock(invoke_mutex, std::try_to_lock);
+	if (!lock.owns_lock()) {
+		return false;
+	}
+	return pw_loop_invoke(pw_thread_loop_get_loop(loop), p_func, 0, nullptr, 0, false, p_user_data) >= 0;
+}
+
 CameraServerLinux::CameraServerLinux(CameraServerExtension *server) :
 		extension::CameraServer(server) {
-	g_autoptr(GError) err = nullptr;
-	proxy = g_dbus_proxy_new_sync(
-			DesktopPortal::get_dbus_session(),
-			G_DBUS_PROXY_FLAGS_NONE, nullptr,
-			"org.freedesktop.portal.Desktop",
-			"/org/freedesktop/portal/desktop",
-			"org.freedesktop.portal.Camera",
-			nullptr, &err);
-	pw_init(nullptr, nullptr);
-	pipewire_connect();
+	startup_thread = std::thread(&CameraServerLinux::startup, this);
 }
 
 CameraServerLinux::~CameraServerLinux() {
+	wait_startup();
+	// Feeds release their PipeWire objects, which has to happen before the loop is gone.
+	feeds.clear();
+	node_ids.clear();
 	if (loop) {
 		pw_thread_loop_lock(loop);
 	}
 	if (registry) {
 		pw_proxy_destroy((pw_proxy *)registry);
 	}
+	HotplugEvent *event = take_hotplug_events();
+	while (event) {
+		HotplugEvent *next = event->next;
+		free_hotplug_event(event);
+		event = next;
+	}
 	if (core) {
 		pw_core_disconnect(core);
 	}
@@ -123,6 +144,174 @@ CameraServerLinux::~CameraServerLinux() {
 	pw_deinit();
 }
 
+void CameraServerLinux::push_hotplug_event(HotplugEvent *p_event) {
+	p_event->next = hotplug_events.load();
+	while (!hotplug_events.compare_exchange_weak(p_event->next, p_event)) {
+	}
+	if (!hotplug_scheduled.exchange(true)) {
+		this_->call_deferred("_process_events");
+	}
+}
+
+CameraServerLinux::HotplugEvent *CameraServerLinux::take_hotplug_events() {
+	// Events are pushed on a stack, reverse them back into arrival order.
+	HotplugEvent *event = hotplug_events.exchange(nullptr);
+	HotplugEvent *ordered = nullptr;
+	while (event) {
+		HotplugEvent *next = event->next;
+		event->next = ordered;
+		ordered = event;
+		event = next;
+	}
+	return ordered;
+}
+
+void CameraServerLinux::free_hotplug_event(HotplugEvent *p_event) {
+	if (p_event->props) {
+		pw_properties_free(p_event->props);
+	}
+	delete p_event;
+}
+
+void CameraServerLinux::process_events() {
+	HashMap<uint32_t, HotplugEvent *> added;
+	HashMap<uint32_t, bool> removed;
+	bool sync_done = false;
+
+	hotplug_scheduled = false;
+	HotplugEvent *event = take_hotplug_events();
+	while (event) {
+		HotplugEvent *next = event->next;
+		HotplugEvent **pending = added.getptr(event->id);
+		switch (event->type) {
+			case HotplugEvent::GLOBAL:
+				if (pending) {
+					free_hotplug_event(*pending);
+				}
+				added[event->id] = event;
+				event = nullptr;
+				break;
+			case HotplugEvent::GLOBAL_REMOVE:
+				// A node that appears and disappears within one batch cancels out.
+				if (pending) {
+					free_hotplug_event(*pending);
+					added.erase(event->id);
+				}
+				if (feeds.has(event->id)) {
+					removed[event->id] = true;
+				}
+				break;
+			case HotplugEvent::SYNC_DONE:
+				sync_done = true;
+				break;
+		}
+		if (event) {
+			free_hotplug_event(event);
+		}
+		event = next;
+	}
+
+	for (const KeyValue<uint32_t, bool> &E : removed) {
+		remove_feed(E.key);
+	}
+	for (const KeyValue<uint32_t, HotplugEvent *> &E : added) {
+		const char *node_name = pw_properties_get(E.value->props, PW_KEY_NODE_NAME);
+		uint32_t *previous_id = node_name ? node_ids.getptr(String::utf8(node_name)) : nullptr;
+		if (previous_id && *previous_id != E.key) {
+			// The node came back under a new id before the removal of the old one arrived.
+			remove_feed(*previous_id);
+		}
+		if (!feeds.has(E.key)) {
+			// The node is bound once its formats are asked for, its stream once the feed is used.
+			std::unique_ptr<CameraFeedLinux> feed_impl = std::make_unique<CameraFeedLinux>(E.key, E.value->version, &E.value->props->dict, core, registry);
+			Ref<CameraFeedExtension> feed = memnew(CameraFeedExtension(std::move(feed_impl)));
+			add_feed(E.key, feed);
+		}
+		free_hotplug_event(E.value);
+	}
+	if (sync_done) {
+		feeds_ready = true;
+		emit_feeds_ready();
+	}
+}
+
+Ref<CameraFeedExtension> CameraServerLinux::get_feed_by_node_name(const String &p_node_name) {
+	uint32_t *id = node_ids.getptr(p_node_name);
+	if (id == nullptr) {
+		return Ref<CameraFeedExtension>();
+	}
+	return feeds[*id];
+}
+
+void CameraServerLinux::add_feed(uint32_t p_id, const Ref<CameraFeedExtension> &p_feed) {
+	CameraFeedLinux *impl = (CameraFeedLinux *)p_feed->get_impl();
+	feeds.insert(p_id, p_feed);
+	if (!impl->get_node_name().is_empty()) {
+		node_ids.insert(impl->get_node_name(), p_id);
+	}
+	this_->get_server()->add_feed(p_feed);
+}
+
+void CameraServerLinux::remove_feed(uint32_t p_id) {
+	Ref<CameraFeedExtension> *feed = feeds.getptr(p_id);
+	if (feed == nullptr) {
+		return;
+	}
+	Ref<CameraFeedExtension> removed = *feed;
+	feeds.erase(p_id);
+	CameraFeedLinux *impl = (CameraFeedLinux *)removed->get_impl();
+	String node_name = impl->get_node_name();
+	uint32_t *node_id = node_ids.getptr(node_name);
+	if (node_id && *node_id == p_id) {
+		node_ids.erase(node_name);
+	}
+	this_->get_server()->remove_feed(removed);
+}
+
+void CameraServerLinux::startup() {
+	g_autoptr(GError) err = nullptr;
+	uint64_t start = Time::get_singleton()->get_ticks_usec();
+	uint64_t phase_start = start;
+	proxy = g_dbus_proxy_new_sync(
+			DesktopPortal::get_dbus_session(),
+			G_DBUS_PROXY_FLAGS_NONE, nullptr,
+			"org.freedesktop.portal.Desktop",
+			"/org/freedesktop/portal/desktop",
+			"org.freedesktop.portal.Camera",
+			nullptr, &err);
+	set_startup_timing("dbus_proxy", phase_start);
+	phase_start = Time::get_singleton()->get_ticks_usec();
+	pw_init(nullptr, nullptr);
+	set_startup_timing("pw_init", phase_start);
+	phase_start = Time::get_singleton()->get_ticks_usec();
+	pipewire_connect();
+	set_startup_timing("pipewire_connect", phase_start);
+	set_startup_timing("startup", start);
+	if (core == nullptr) {
+		// Nothing to enumerate until camera access is granted.
+		feeds_ready = true;
+		emit_feeds_ready();
+	}
+	startup_done = true;
+	if (permission_requested.exchange(false)) {
+		// request_permission() came in while starting up and already returned false.
+		if (start_permission_request()) {
+			this_->call_deferred("emit_signal", "permission_result", true);
+		}
+	}
+}
+
+void CameraServerLinux::wait_startup() {
+	if (startup_thread.joinable()) {
+		startup_thread.join();
+	}
+}
+
+void CameraServerLinux::set_startup_timing(const String &p_phase, uint64_t p_start) {
+	std::lock_guard<std::mutex> lock(timings_mutex);
+	startup_timings[p_phase] = Time::get_singleton()->get_ticks_usec() - p_start;
+}
+
 bool CameraServerLinux::is_camera_present() {
 	g_autoptr(GVariant) result = nullptr;
 	if (proxy == nullptr) {
@@ -197,12 +386,16 @@ void CameraServerLinux::pipewire_connect() {
 		registry = pw_core_get_registry(core, PW_VERSION_REGISTRY, 0);
 		if (registry) {
 			pw_registry_add_listener(registry, &registry_listener, &registry_events, this);
+			// Globals are all announced before the reply to this sync.
+			pw_core_add_listener(core, &core_listener, &core_events, this);
+			registry_sync_start = Time::get_singleton()->get_ticks_usec();
+			registry_sync_seq = pw_core_sync(core, PW_ID_CORE, 0);
 		}
 	}
 	pw_thread_loop_unlock(loop);
 }
 
-bool CameraServerLinux::request_permission() {
+bool CameraServerLinux::start_permission_request() {
 	if (open_pipewire_remote() != -1) {
 		return true;
 	}
@@ -210,13 +403,34 @@ bool CameraServerLinux::request_permission() {
 	return false;
 }
 
+bool CameraServerLinux::request_permission() {
+	// Never waits for startup, a request made before it finishes is sent by the startup thread and
+	// answered with permission_result.
+	permission_requested = true;
+	if (!startup_done || !permission_requested.exchange(false)) {
+		return false;
+	}
+	return start_permission_request();
+}
+
 bool CameraServerLinux::permission_granted() {
+	// Not known before startup finishes, permission_result follows a request made meanwhile.
+	if (!startup_done) {
+		return false;
+	}
 	if (core) {
 		return true;
 	}
 	return open_pipewire_remote() != -1;
 }
 
+bool CameraServerLinux::is_feeds_ready() { return feeds_ready; }
+
+Dictionary CameraServerLinux::get_startup_timings() {
+	std::lock_guard<std::mutex> lock(timings_mutex);
+	return startup_timings.duplicate();
+}
+
 void CameraServerExtension::set_impl() {
 	impl = std::make_unique<CameraServerLinux>(this);
 }
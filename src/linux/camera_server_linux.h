@@ -6,28 +6,90 @@
 #include <gio/gio.h>
 #include <pipewire/pipewire.h>
 
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "godot_cpp/templates/hash_map.hpp"
+#include "godot_cpp/templates/hash_set.hpp"
+
+#include "camera_feed.h"
+
 static void on_permission_callback(GDBusConnection *connection, const char *sender_name, const char *object_path, const char *interface_name, const char *signal_name, GVariant *parameters, void *user_data);
 static void on_registry_event_global(void *user_data, uint32_t id, uint32_t permissions, const char *type, uint32_t version, const struct spa_dict *props);
 static void on_registry_event_global_remove(void *user_data, uint32_t id);
+static void on_core_done(void *user_data, uint32_t id, int seq);
 
 class CameraServerLinux : public extension::CameraServer {
 private:
+	// Registry changes are pushed from the PipeWire thread and applied in batches on the main thread.
+	struct HotplugEvent {
+		enum Type {
+			GLOBAL,
+			GLOBAL_REMOVE,
+			SYNC_DONE,
+		};
+
+		Type type;
+		uint32_t id = 0;
+		uint32_t version = 0;
+		pw_properties *props = nullptr;
+		HotplugEvent *next = nullptr;
+	};
+
 	static pw_thread_loop *loop;
+	// Older PipeWire releases share one invoke queue between all foreign threads.
+	static std::mutex invoke_mutex;
 
 	GDBusProxy *proxy = nullptr;
 	pw_core *core = nullptr;
 	pw_context *context = nullptr;
 	pw_registry *registry = nullptr;
 	spa_hook registry_listener = {};
+	spa_hook core_listener = {};
+	HashMap<uint32_t, Ref<CameraFeedExtension>> feeds;
+	// Node names survive replugging, ids do not.
+	HashMap<String, uint32_t> node_ids;
+	// Ids of camera nodes announced by the registry, loop thread only.
+	HashSet<uint32_t> camera_nodes;
+	std::atomic<HotplugEvent *> hotplug_events = nullptr;
+	std::atomic<bool> hotplug_scheduled = false;
+
+	std::thread startup_thread;
+	std::atomic<bool> feeds_ready = false;
+	// Published by the startup thread once the portal proxy and PipeWire connection are set up.
+	std::atomic<bool> startup_done = false;
+	// A request_permission() the startup thread still has to send.
+	std::atomic<bool> permission_requested = false;
+	int registry_sync_seq = -1;
+	uint64_t registry_sync_start = 0;
+	std::mutex timings_mutex;
+	Dictionary startup_timings;
+
+	void startup();
+	void wait_startup();
+	void set_startup_timing(const String &p_phase, uint64_t p_start);
+
+	void push_hotplug_event(HotplugEvent *p_event);
+	HotplugEvent *take_hotplug_events();
+	void free_hotplug_event(HotplugEvent *p_event);
+
+	void add_feed(uint32_t p_id, const Ref<CameraFeedExtension> &p_feed);
+	void remove_feed(uint32_t p_id);
 
 	bool is_camera_present();
 	void access_camera();
 	int open_pipewire_remote();
+	bool start_permission_request();
 
 	void pipewire_connect();
 
 public:
 	static pw_thread_loop *get_loop();
+	// Queues p_func on the loop thread, or runs it right away when called from there.
+	static int invoke(spa_invoke_func_t p_func, void *p_user_data);
+	// Like invoke(), but gives up instead of waiting for another thread to finish queueing.
+	static bool try_invoke(spa_invoke_func_t p_func, void *p_user_data);
 
 	CameraServerLinux(CameraServerExtension *server);
 	~CameraServerLinux();
@@ -35,9 +97,16 @@ public:
 	bool request_permission() override;
 	bool permission_granted() override;
 
+	bool is_feeds_ready() override;
+	Dictionary get_startup_timings() override;
+	Ref<CameraFeedExtension> get_feed_by_node_name(const String &p_node_name) override;
+
+	void process_events() override;
+
 	friend void on_permission_callback(GDBusConnection *connection, const char *sender_name, const char *object_path, const char *interface_name, const char *signal_name, GVariant *parameters, void *user_data);
 	friend void on_registry_event_global(void *user_data, uint32_t id, uint32_t permissions, const char *type, uint32_t version, const struct spa_dict *props);
 	friend void on_registry_event_global_remove(void *user_data, uint32_t id);
+	friend void on_core_done(void *user_data, uint32_t id, int seq);
 };
 
 #endif
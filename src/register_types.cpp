@@ -5,6 +5,7 @@
 #include <godot_cpp/godot.hpp>
 
 #include "camera_feed.h"
+#include "camera_feed_group.h"
 #include "camera_server.h"
 
 using namespace godot;
@@ -12,6 +13,7 @@ using namespace godot;
 void initialize_camera_module(ModuleInitializationLevel p_level) {
 	if (p_level == MODULE_INITIALIZATION_LEVEL_SCENE) {
 		ClassDB::register_class<CameraFeedExtension>();
+		ClassDB::register_class<CameraFeedGroup>();
 		ClassDB::register_class<CameraServerExtension>();
 	}
 }
@@ -202,7 +202,7 @@ void CameraFeedWindows::deactivate_feed() {
 	reader = nullptr;
 }
 
-TypedArray<Dictionary> CameraFeedWindows::get_formats() const {
+TypedArray<Dictionary> CameraFeedWindows::get_formats() {
 	TypedArray<Dictionary> formats;
 	IMFMediaType *type = nullptr;
 	DWORD count = 0;
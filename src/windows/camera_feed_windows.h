@@ -85,7 +85,7 @@ public:
 	bool activate_feed() override;
 	void deactivate_feed() override;
 
-	TypedArray<Dictionary> get_formats() const override;
+	TypedArray<Dictionary> get_formats() override;
 	bool set_format(int p_index, const Dictionary &p_parameters) override;
 
 	void set_this(CameraFeedExtension *p_feed) override;